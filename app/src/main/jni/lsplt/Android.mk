@@ -2,7 +2,7 @@ LOCAL_PATH := $(call my-dir)
 
 include $(CLEAR_VARS)
 LOCAL_MODULE            := lsplt
-LOCAL_SRC_FILES         := elf_util.cc lsplt.cc
+LOCAL_SRC_FILES         := elf_util.cc lsplt.cc maps_util.cc plan_cache.cc zip_util.cc
 LOCAL_C_INCLUDES        := $(LOCAL_PATH)/include
 LOCAL_EXPORT_C_INCLUDES := $(LOCAL_PATH)/include
 LOCAL_STATIC_LIBRARIES  := cxx
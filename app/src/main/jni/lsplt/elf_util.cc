@@ -1,10 +1,24 @@
 #include "elf_util.hpp"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
 #include <cstring>
 #include <type_traits>
 #include <vector>
 #include <tuple>
 
+#include "hash.hpp"
+#include "stats.hpp"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 #if defined(__arm__)
 #define ELF_R_GENERIC_JUMP_SLOT R_ARM_JUMP_SLOT  //.rel.plt
 #define ELF_R_GENERIC_GLOB_DAT R_ARM_GLOB_DAT    //.rel.dyn
@@ -52,63 +66,256 @@ inline constexpr auto SetByOffset(T &ptr, ElfW(Addr) base, ElfW(Addr) bias, ElfW
     return false;
 }
 
+// Hashing all imports is what building the import index costs, so it mixes eight bytes at a
+// time instead of going through the byte-wise GNU hash.
+inline uint32_t ImportHash(std::string_view name) {
+    constexpr uint64_t kMultiplier = 0x9e3779b97f4a7c15;
+    uint64_t hash = name.size() * kMultiplier;
+    uint64_t word;
+    for (; name.size() >= sizeof(word); name.remove_prefix(sizeof(word))) {
+        memcpy(&word, name.data(), sizeof(word));
+        hash = (hash ^ word) * kMultiplier;
+        hash ^= hash >> 32;
+    }
+    word = 0;
+    memcpy(&word, name.data(), name.size());
+    hash = (hash ^ word) * kMultiplier;
+    return static_cast<uint32_t>(hash >> 32);
+}
+
+// most symbols a relocation scan compares against at once
+constexpr size_t kMaxScanSymbols = 16;
+
+// Reads one SLEB128 number, returns false at the end of the stream or on an overlong number.
+inline bool DecodeSleb128(const uint8_t *&current, const uint8_t *end, ElfW(Addr) &value) {
+    static constexpr uint64_t kContinuation = 0x8080808080808080;
+    // numbers of up to 8 bytes are decoded from one unaligned load without branching on their
+    // length, which is what mostly costs in a byte loop
+    if (uint64_t word; end - current >= static_cast<ptrdiff_t>(sizeof(word))) {
+        memcpy(&word, current, sizeof(word));
+        if (auto stops = ~word & kContinuation; stops) {
+            const auto bytes = static_cast<unsigned>(__builtin_ctzll(stops)) / 8 + 1;
+            current += bytes;
+            word &= stops ^ (stops - 1);
+            // gather the 7-bit groups: pairs into 14 bits, then 28 bits, then 56 bits
+            word = ((word & 0x7f007f007f007f00) >> 1) | (word & 0x007f007f007f007f);
+            word = ((word & 0x3fff00003fff0000) >> 2) | (word & 0x00003fff00003fff);
+            word = ((word & 0x0fffffff00000000) >> 4) | (word & 0x000000000fffffff);
+            // sign extend
+            const auto unused = 64 - bytes * 7;
+            value = static_cast<ElfW(Addr)>(static_cast<int64_t>(word << unused) >> unused);
+            return true;
+        }
+    }
+    value = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+        if (current == end || shift >= sizeof(value) * 8) return false;
+        byte = *current++;
+        value |= static_cast<ElfW(Addr)>(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    // sign extend
+    if (shift < sizeof(value) * 8 && (byte & 0x40)) value |= ~ElfW(Addr){0} << shift;
+    return true;
+}
+
+// Streams the APS2 packed relocations of DT_ANDROID_REL[A] into visitor(r_offset, r_info), see
+// https://cs.android.com/android/platform/superproject/+/main:bionic/linker/linker_reloc_iterators.h
+// The stream is a list of SLEB128 numbers: the relocation count and the initial offset, then
+// groups of relocations, each starting with its size and flags and the fields its members share.
+// Addends are decoded to advance the stream only. Returning true from the visitor stops early.
+// The decoder state lives in locals rather than in an iterator object, as the byte loads could
+// otherwise alias it and force it to memory on every number.
+template <typename Visitor>
+void ForEachPackedReloc(ElfW(Addr) data, size_t size, bool is_rela, Visitor &&visitor) {
+    static constexpr ElfW(Addr) kGroupedByInfo = 1;
+    static constexpr ElfW(Addr) kGroupedByOffsetDelta = 2;
+    static constexpr ElfW(Addr) kGroupedByAddend = 4;
+    static constexpr ElfW(Addr) kGroupHasAddend = 8;
+
+    const auto *current = reinterpret_cast<const uint8_t *>(data);
+    const auto *end = current + size;
+    ElfW(Addr) relocs_left, offset, info = 0, addend;
+    if (!DecodeSleb128(current, end, relocs_left) || !DecodeSleb128(current, end, offset)) return;
+    while (relocs_left) {
+        ElfW(Addr) group_size, group_flags, group_offset_delta = 0;
+        if (!DecodeSleb128(current, end, group_size) ||
+            !DecodeSleb128(current, end, group_flags) || !group_size || group_size > relocs_left) {
+            return;
+        }
+        if ((group_flags & kGroupedByOffsetDelta) &&
+            !DecodeSleb128(current, end, group_offset_delta)) {
+            return;
+        }
+        if ((group_flags & kGroupedByInfo) && !DecodeSleb128(current, end, info)) return;
+        const bool has_addend = group_flags & kGroupHasAddend;
+        if (has_addend && !is_rela) return;
+        const bool addend_per_reloc = has_addend && !(group_flags & kGroupedByAddend);
+        if (has_addend && !addend_per_reloc && !DecodeSleb128(current, end, addend)) return;
+        relocs_left -= group_size;
+        for (; group_size; --group_size) {
+            if (group_flags & kGroupedByOffsetDelta) {
+                offset += group_offset_delta;
+            } else if (ElfW(Addr) delta; DecodeSleb128(current, end, delta)) {
+                offset += delta;
+            } else {
+                return;
+            }
+            if (!(group_flags & kGroupedByInfo) && !DecodeSleb128(current, end, info)) return;
+            if (addend_per_reloc && !DecodeSleb128(current, end, addend)) return;
+            if (visitor(offset, info)) return;
+        }
+    }
+}
+
+template <typename T>
+inline bool HasSymbol(const T &rel, std::span<const uint32_t> symbols) {
+    return std::find(symbols.begin(), symbols.end(), ELF_R_SYM(rel.r_info)) != symbols.end();
+}
+
+template <typename T>
+const T *FindSymbolsScalar(const T *rel, const T *end, std::span<const uint32_t> symbols) {
+    while (rel < end && !HasSymbol(*rel, symbols)) ++rel;
+    return rel;
+}
+
+#if defined(__x86_64__)
+// The symbol is the upper half of r_info, so it is gathered as a dword from 8 records at a time.
+template <typename T>
+[[gnu::target("avx2")]] const T *FindSymbolsAvx2(const T *rel, const T *end,
+                                                 std::span<const uint32_t> symbols) {
+    static constexpr int kStride = sizeof(T) / sizeof(uint32_t);
+    static constexpr int kSym = offsetof(T, r_info) / sizeof(uint32_t) + 1;
+    const auto offsets =
+        _mm256_setr_epi32(kSym, kSym + kStride, kSym + 2 * kStride, kSym + 3 * kStride,
+                          kSym + 4 * kStride, kSym + 5 * kStride, kSym + 6 * kStride,
+                          kSym + 7 * kStride);
+    __m256i wanted[kMaxScanSymbols];
+    for (size_t i = 0; i < symbols.size(); i++) {
+        wanted[i] = _mm256_set1_epi32(static_cast<int>(symbols[i]));
+    }
+    for (; end - rel >= 8; rel += 8) {
+        auto syms = _mm256_i32gather_epi32(reinterpret_cast<const int *>(rel), offsets, 4);
+        auto hits = _mm256_cmpeq_epi32(syms, wanted[0]);
+        for (size_t i = 1; i < symbols.size(); i++) {
+            hits = _mm256_or_si256(hits, _mm256_cmpeq_epi32(syms, wanted[i]));
+        }
+        if (auto mask = _mm256_movemask_ps(_mm256_castsi256_ps(hits))) {
+            return rel + __builtin_ctz(mask);
+        }
+    }
+    return FindSymbolsScalar(rel, end, symbols);
+}
+#endif
+
+// Finds the first record in [rel, end) referring to one of symbols, comparing several records
+// at once where the CPU allows.
+template <typename T>
+const T *FindSymbols(const T *rel, const T *end, std::span<const uint32_t> symbols) {
+    if (symbols.empty() || symbols.size() > kMaxScanSymbols) {
+        return FindSymbolsScalar(rel, end, symbols);
+    }
+#if defined(__x86_64__)
+    static const bool kHasAvx2 = __builtin_cpu_supports("avx2");
+    if (kHasAvx2) return FindSymbolsAvx2(rel, end, symbols);
+    return FindSymbolsScalar(rel, end, symbols);
+#else
+    return FindSymbolsScalar(rel, end, symbols);
+#endif
+}
+
 }  // namespace
 
-Elf::Elf(uintptr_t base_addr) : base_addr_(base_addr) {
-    header_ = reinterpret_cast<decltype(header_)>(base_addr);
+uintptr_t Elf::LoadBias(uintptr_t base_addr) {
+    const auto *header = reinterpret_cast<const ElfW(Ehdr) *>(base_addr);
 
     // check magic
-    if (0 != memcmp(header_->e_ident, ELFMAG, SELFMAG)) return;
+    if (0 != memcmp(header->e_ident, ELFMAG, SELFMAG)) return 0;
 
         // check class (64/32)
 #if defined(__LP64__)
-    if (ELFCLASS64 != header_->e_ident[EI_CLASS]) return;
+    if (ELFCLASS64 != header->e_ident[EI_CLASS]) return 0;
 #else
-    if (ELFCLASS32 != header_->e_ident[EI_CLASS]) return;
+    if (ELFCLASS32 != header->e_ident[EI_CLASS]) return 0;
 #endif
 
     // check endian (little/big)
-    if (ELFDATA2LSB != header_->e_ident[EI_DATA]) return;
+    if (ELFDATA2LSB != header->e_ident[EI_DATA]) return 0;
 
     // check version
-    if (EV_CURRENT != header_->e_ident[EI_VERSION]) return;
+    if (EV_CURRENT != header->e_ident[EI_VERSION]) return 0;
 
     // check type
-    if (ET_EXEC != header_->e_type && ET_DYN != header_->e_type) return;
+    if (ET_EXEC != header->e_type && ET_DYN != header->e_type) return 0;
 
         // check machine
 #if defined(__arm__)
-    if (EM_ARM != header_->e_machine) return;
+    if (EM_ARM != header->e_machine) return 0;
 #elif defined(__aarch64__)
-    if (EM_AARCH64 != header_->e_machine) return;
+    if (EM_AARCH64 != header->e_machine) return 0;
 #elif defined(__i386__)
-    if (EM_386 != header_->e_machine) return;
+    if (EM_386 != header->e_machine) return 0;
 #elif defined(__x86_64__)
-    if (EM_X86_64 != header_->e_machine) return;
+    if (EM_X86_64 != header->e_machine) return 0;
 #elif defined(__riscv)
-    if (EM_RISCV != header_->e_machine) return;
+    if (EM_RISCV != header->e_machine) return 0;
 #else
-    return;
+    return 0;
 #endif
 
     // check version
-    if (EV_CURRENT != header_->e_version) return;
+    if (EV_CURRENT != header->e_version) return 0;
+
+    uintptr_t bias_addr = 0;
+    auto ph_off = base_addr + header->e_phoff;
+    for (int i = 0; i < header->e_phnum; i++, ph_off += header->e_phentsize) {
+        const auto *program_header = reinterpret_cast<const ElfW(Phdr) *>(ph_off);
+        if (program_header->p_type == PT_LOAD && program_header->p_offset == 0 &&
+            base_addr >= program_header->p_vaddr) {
+            bias_addr = base_addr - program_header->p_vaddr;
+        }
+    }
+    return bias_addr;
+}
 
+Elf::Elf(uintptr_t base_addr) : base_addr_(base_addr), bias_addr_(LoadBias(base_addr)) {
+    if (!bias_addr_) return;
+    header_ = reinterpret_cast<decltype(header_)>(base_addr);
     program_header_ = OffsetOf<decltype(program_header_)>(header_, header_->e_phoff);
+    if (header_->e_phentsize == sizeof(ElfW(Phdr))) program_header_count_ = header_->e_phnum;
 
     auto ph_off = reinterpret_cast<uintptr_t>(program_header_);
     for (int i = 0; i < header_->e_phnum; i++, ph_off += header_->e_phentsize) {
         auto *program_header = reinterpret_cast<ElfW(Phdr) *>(ph_off);
-        if (program_header->p_type == PT_LOAD && program_header->p_offset == 0) {
-            if (base_addr_ >= program_header->p_vaddr) {
-                bias_addr_ = base_addr_ - program_header->p_vaddr;
-            }
-        } else if (program_header->p_type == PT_DYNAMIC) {
+        if (program_header->p_type == PT_DYNAMIC) {
             dynamic_ = reinterpret_cast<decltype(dynamic_)>(program_header->p_vaddr);
             dynamic_size_ = program_header->p_memsz;
         }
     }
+    ParseDynamic();
+}
+
+Elf::Elf(uintptr_t base_addr, uintptr_t bias_addr, const ElfW(Phdr) * phdr, size_t phnum)
+    : base_addr_(base_addr), bias_addr_(bias_addr) {
+    // the linker has already validated the header and told us the load bias
+    header_ = reinterpret_cast<decltype(header_)>(base_addr);
+    program_header_ = const_cast<decltype(program_header_)>(phdr);
+    program_header_count_ = phnum;
+    for (size_t i = 0; i < phnum; i++) {
+        if (phdr[i].p_type == PT_DYNAMIC) {
+            dynamic_ = reinterpret_cast<decltype(dynamic_)>(phdr[i].p_vaddr);
+            dynamic_size_ = phdr[i].p_memsz;
+            break;
+        }
+    }
+    ParseDynamic();
+}
+
+void Elf::ParseDynamic() {
     if (!dynamic_ || !bias_addr_) return;
+    Count(stats.elfs_parsed);
     dynamic_ =
         reinterpret_cast<decltype(dynamic_)>(bias_addr_ + reinterpret_cast<uintptr_t>(dynamic_));
 
@@ -149,6 +356,7 @@ Elf::Elf(uintptr_t base_addr) : base_addr_(base_addr) {
             break;
         case DT_ANDROID_REL:
         case DT_ANDROID_RELA: {
+            is_android_rela_ = dynamic->d_tag == DT_ANDROID_RELA;
             if (!SetByOffset(rel_android_, base_addr_, bias_addr_, dynamic->d_un.d_ptr)) return;
             break;
         }
@@ -197,17 +405,13 @@ Elf::Elf(uintptr_t base_addr) : base_addr_(base_addr) {
     valid_ = true;
 }
 
-uint32_t Elf::GnuLookup(std::string_view name) const {
+uint32_t Elf::GnuLookup(const SymbolKey &symbol) const {
     static constexpr auto kBloomMaskBits = sizeof(ElfW(Addr)) * 8;
-    static constexpr uint32_t kInitialHash = 5381;
-    static constexpr uint32_t kHashShift = 5;
 
     if (!bucket_ || !bloom_) return 0;
 
-    uint32_t hash = kInitialHash;
-    for (unsigned char chr : name) {
-        hash += (hash << kHashShift) + chr;
-    }
+    const auto name = symbol.name;
+    const auto hash = symbol.gnu_hash;
 
     auto bloom_word = bloom_[(hash / kBloomMaskBits) % bloom_size_];
     uintptr_t mask = 0 | uintptr_t{1} << (hash % kBloomMaskBits) |
@@ -219,6 +423,7 @@ uint32_t Elf::GnuLookup(std::string_view name) const {
             do {
                 auto *sym = dyn_sym_ + idx;
                 if (((chain_[idx] ^ hash) >> 1) == 0 && name == strings + sym->st_name) {
+                    Count(stats.gnu_lookups);
                     return idx;
                 }
             } while ((chain_[idx++] & 1) == 0);
@@ -227,72 +432,113 @@ uint32_t Elf::GnuLookup(std::string_view name) const {
     return 0;
 }
 
-uint32_t Elf::ElfLookup(std::string_view name) const {
-    static constexpr uint32_t kHashMask = 0xf0000000;
-    static constexpr uint32_t kHashShift = 24;
-    uint32_t hash = 0;
-    uint32_t tmp;
-
+uint32_t Elf::ElfLookup(const SymbolKey &symbol) const {
     if (!bucket_ || bloom_) return 0;
 
-    for (unsigned char chr : name) {
-        hash = (hash << 4) + chr;
-        tmp = hash & kHashMask;
-        hash ^= tmp;
-        hash ^= tmp >> kHashShift;
-    }
+    const auto name = symbol.name;
+    const auto hash = symbol.elf_hash;
     const char *strings = dyn_str_;
 
     for (auto idx = bucket_[hash % bucket_count_]; idx != 0; idx = chain_[idx]) {
         auto *sym = dyn_sym_ + idx;
         if (name == strings + sym->st_name) {
+            Count(stats.sysv_lookups);
             return idx;
         }
     }
     return 0;
 }
 
-uint32_t Elf::LinearLookup(std::string_view name) const {
-    if (!dyn_sym_ || !sym_offset_) return 0;
-    for (uint32_t idx = 0; idx < sym_offset_; idx++) {
-        auto *sym = dyn_sym_ + idx;
-        if (name == dyn_str_ + sym->st_name) {
+// pending is how many more imports the caller is about to look up after this one
+uint32_t Elf::ImportLookup(std::string_view name, size_t pending) const {
+    // building the index hashes every import, which costs about ten linear scans, so a library
+    // that is only asked for a few symbols never pays for it
+    static constexpr size_t kMaxImportScans = 8;
+    if (!dyn_sym_ || sym_offset_ <= 1) return 0;
+    if (import_index_.empty()) {
+        if (import_scans_ + pending < kMaxImportScans) {
+            ++import_scans_;
+            for (uint32_t idx = 1; idx < sym_offset_; idx++) {
+                if (name == dyn_str_ + dyn_sym_[idx].st_name) {
+                    Count(stats.linear_lookups);
+                    return idx;
+                }
+            }
+            return 0;
+        }
+        // at most half full; inserting in index order keeps the first of duplicated names first
+        import_index_.resize(std::bit_ceil(size_t{sym_offset_} * 2));
+        const auto mask = import_index_.size() - 1;
+        for (uint32_t idx = 1; idx < sym_offset_; idx++) {
+            auto sym_hash = ImportHash(dyn_str_ + dyn_sym_[idx].st_name);
+            auto slot = sym_hash & mask;
+            while (import_index_[slot].idx) slot = (slot + 1) & mask;
+            import_index_[slot] = {sym_hash, idx};
+        }
+    }
+    const auto mask = import_index_.size() - 1;
+    const auto hash = ImportHash(name);
+    for (auto slot = hash & mask; import_index_[slot].idx; slot = (slot + 1) & mask) {
+        const auto &[sym_hash, idx] = import_index_[slot];
+        if (sym_hash == hash && name == dyn_str_ + dyn_sym_[idx].st_name) {
+            Count(stats.linear_lookups);
             return idx;
         }
     }
     return 0;
 }
 
-std::vector<uintptr_t> Elf::FindPltAddr(std::string_view name) const {
-    std::vector<uintptr_t> res;
+bool Elf::Imports(const SymbolKey &symbol, size_t pending) const {
+    // DT_HASH holds undefined symbols too, DT_GNU_HASH leaves them below sym_offset_
+    uint32_t idx = ElfLookup(symbol);
+    if (!idx) idx = ImportLookup(symbol.name, pending);
+    return idx && dyn_sym_[idx].st_shndx == SHN_UNDEF;
+}
 
-    uint32_t idx = GnuLookup(name);
-    if (!idx) idx = ElfLookup(name);
-    if (!idx) idx = LinearLookup(name);
-    if (!idx) return res;
+// Calls visitor(sym, addr, is_plt) for every JUMP_SLOT in .rel(a).plt, then for every GLOB_DAT
+// and ABS in .rel(a).dyn and the packed android relocations, in table order, restricted to the
+// given symbols unless there are none. Returning true from the visitor skips the rest of the
+// current table.
+template <typename Visitor>
+void Elf::ForEachSlot(std::span<const uint32_t> symbols, Visitor &&visitor) const {
+    auto visit = [&](auto r_info, auto r_offset, bool is_plt) -> bool {
+        auto r_sym = ELF_R_SYM(r_info);
+        auto r_type = ELF_R_TYPE(r_info);
+        if (!r_sym) return false;
+        if (!symbols.empty() &&
+            std::find(symbols.begin(), symbols.end(), r_sym) == symbols.end()) {
+            return false;
+        }
+        if (is_plt && r_type != ELF_R_GENERIC_JUMP_SLOT) return false;
+        if (!is_plt && r_type != ELF_R_GENERIC_ABS && r_type != ELF_R_GENERIC_GLOB_DAT) {
+            return false;
+        }
+        auto addr = bias_addr_ + r_offset;
+        if (addr <= base_addr_) return false;
+        return visitor(static_cast<uint32_t>(r_sym), addr, is_plt);
+    };
 
+    // counted here and added to the stats once
+    size_t walked = 0;
     auto looper = [&]<typename T>(auto begin, auto size, bool is_plt) -> void {
+        const auto *rel_begin = reinterpret_cast<const T *>(begin);
         const auto *rel_end = reinterpret_cast<const T *>(begin + size);
-        for (const auto *rel = reinterpret_cast<const T *>(begin); rel < rel_end; ++rel) {
-            auto r_info = rel->r_info;
-            auto r_offset = rel->r_offset;
-            auto r_sym = ELF_R_SYM(r_info);
-            auto r_type = ELF_R_TYPE(r_info);
-            if (r_sym != idx) continue;
-            if (is_plt && r_type != ELF_R_GENERIC_JUMP_SLOT) continue;
-            if (!is_plt && r_type != ELF_R_GENERIC_ABS && r_type != ELF_R_GENERIC_GLOB_DAT) {
-                continue;
+        const auto *rel = rel_begin;
+        if (symbols.empty()) {
+            for (; rel < rel_end; ++rel) {
+                if (visit(rel->r_info, rel->r_offset, is_plt)) break;
+            }
+        } else {
+            for (rel = FindSymbols(rel_begin, rel_end, symbols); rel < rel_end;
+                 rel = FindSymbols(rel + 1, rel_end, symbols)) {
+                if (visit(rel->r_info, rel->r_offset, is_plt)) break;
             }
-            auto addr = bias_addr_ + r_offset;
-            if (addr > base_addr_) res.emplace_back(addr);
-            if (is_plt) break;
         }
+        walked += std::min(rel + 1, rel_end) - rel_begin;
     };
 
-    for (const auto &[rel, rel_size, is_plt] :
-         {std::make_tuple(rel_plt_, rel_plt_size_, true),
-          std::make_tuple(rel_dyn_, rel_dyn_size_, false),
-          std::make_tuple(rel_android_, rel_android_size_, false)}) {
+    for (const auto &[rel, rel_size, is_plt] : {std::make_tuple(rel_plt_, rel_plt_size_, true),
+                                                std::make_tuple(rel_dyn_, rel_dyn_size_, false)}) {
         if (!rel) continue;
         if (is_use_rela_) {
             looper.template operator()<ElfW(Rela)>(rel, rel_size, is_plt);
@@ -301,5 +547,220 @@ std::vector<uintptr_t> Elf::FindPltAddr(std::string_view name) const {
         }
     }
 
+    if (rel_android_) {
+        ForEachPackedReloc(
+            rel_android_, rel_android_size_, is_android_rela_,
+            [&](auto r_offset, auto r_info) {
+                ++walked;
+                return visit(r_info, r_offset, false);
+            });
+    }
+    Count(stats.relocations_walked, walked);
+}
+
+void Elf::BuildRelocIndex() const {
+    struct Slot {
+        uint32_t sym;
+        bool is_plt;
+        uintptr_t addr;
+    };
+    std::vector<Slot> slots;
+    uint32_t max_sym = 0;
+    ForEachSlot({}, [&](uint32_t sym, uintptr_t addr, bool is_plt) {
+        slots.emplace_back(sym, is_plt, addr);
+        max_sym = std::max(max_sym, sym);
+        return false;
+    });
+
+    // counting sort by symbol, which keeps the table order within each symbol
+    reloc_offsets_.assign(size_t{max_sym} + 2, 0);
+    std::vector<bool> has_plt(size_t{max_sym} + 1);
+    for (auto &slot : slots) {
+        if (slot.is_plt) {
+            // only the first JUMP_SLOT of a symbol is its PLT entry
+            if (has_plt[slot.sym]) {
+                slot.sym = 0;
+                continue;
+            }
+            has_plt[slot.sym] = true;
+        }
+        ++reloc_offsets_[slot.sym + 1];
+    }
+    for (size_t i = 1; i < reloc_offsets_.size(); i++) {
+        reloc_offsets_[i] += reloc_offsets_[i - 1];
+    }
+    reloc_slots_.resize(reloc_offsets_.back());
+    std::vector<uint32_t> next(reloc_offsets_.begin(), reloc_offsets_.end() - 1);
+    for (const auto &slot : slots) {
+        if (slot.sym) reloc_slots_[next[slot.sym]++] = slot.addr;
+    }
+}
+
+std::vector<uintptr_t> Elf::FindPltAddr(const SymbolKey &symbol) const {
+    return std::move(FindPltAddr({&symbol, 1}).front());
+}
+
+std::vector<std::vector<uintptr_t>> Elf::FindPltAddr(std::span<const SymbolKey> names) const {
+    std::vector<std::vector<uintptr_t>> res(names.size());
+
+    std::vector<uint32_t> indices;
+    indices.reserve(names.size());
+    for (const auto &name : names) {
+        uint32_t idx = GnuLookup(name);
+        if (!idx) idx = ElfLookup(name);
+        if (!idx) idx = ImportLookup(name.name, names.size() - indices.size() - 1);
+        indices.emplace_back(idx);
+    }
+    std::vector<uint32_t> symbols(indices);
+    std::sort(symbols.begin(), symbols.end());
+    symbols.erase(std::unique(symbols.begin(), symbols.end()), symbols.end());
+    if (!symbols.empty() && !symbols.front()) symbols.erase(symbols.begin());
+    if (symbols.empty()) return res;
+
+    if (reloc_offsets_.empty() && !relocs_scanned_ && symbols.size() <= kMaxScanSymbols) {
+        // walking all relocations once is cheaper than indexing them for a few symbols
+        relocs_scanned_ = true;
+        std::vector<std::vector<uintptr_t>> found(symbols.size());
+        std::vector<bool> has_plt(symbols.size());
+        size_t plts = 0;
+        ForEachSlot(symbols, [&](uint32_t sym, uintptr_t addr, bool is_plt) {
+            auto pos = std::lower_bound(symbols.begin(), symbols.end(), sym) - symbols.begin();
+            if (is_plt) {
+                // only the first JUMP_SLOT of a symbol is its PLT entry
+                if (has_plt[pos]) return false;
+                has_plt[pos] = true;
+                found[pos].emplace_back(addr);
+                return ++plts == symbols.size();
+            }
+            found[pos].emplace_back(addr);
+            return false;
+        });
+        for (size_t i = 0; i < names.size(); ++i) {
+            if (!indices[i]) continue;
+            res[i] = found[std::lower_bound(symbols.begin(), symbols.end(), indices[i]) -
+                           symbols.begin()];
+        }
+        return res;
+    }
+
+    if (reloc_offsets_.empty()) BuildRelocIndex();
+    for (size_t i = 0; i < names.size(); ++i) {
+        if (auto idx = indices[i]; idx && idx + 1 < reloc_offsets_.size()) {
+            res[i].assign(reloc_slots_.begin() + reloc_offsets_[idx],
+                          reloc_slots_.begin() + reloc_offsets_[idx + 1]);
+        }
+    }
     return res;
 }
+
+std::string_view Elf::BuildId() const {
+    static constexpr char kGnu[] = "GNU";
+    if (!valid_) return {};
+    const std::span phdrs(program_header_, program_header_count_);
+    for (const auto &note : phdrs) {
+        if (note.p_type != PT_NOTE) continue;
+        // notes outside of every PT_LOAD are not in memory
+        if (std::ranges::none_of(phdrs, [&](const auto &load) {
+                return load.p_type == PT_LOAD && load.p_vaddr <= note.p_vaddr &&
+                       note.p_vaddr + note.p_filesz <= load.p_vaddr + load.p_filesz;
+            })) {
+            continue;
+        }
+        const size_t align = note.p_align == 8 ? 8 : 4;
+        auto align_up = [align](size_t size) { return (size + align - 1) & ~(align - 1); };
+        for (auto cur = bias_addr_ + note.p_vaddr, end = cur + note.p_filesz;
+             cur + sizeof(ElfW(Nhdr)) <= end;) {
+            const auto *header = reinterpret_cast<const ElfW(Nhdr) *>(cur);
+            auto name = cur + sizeof(ElfW(Nhdr));
+            auto desc = name + align_up(header->n_namesz);
+            auto next = desc + align_up(header->n_descsz);
+            if (next > end || next <= cur) break;
+            if (header->n_type == NT_GNU_BUILD_ID && header->n_namesz == sizeof(kGnu) &&
+                memcmp(reinterpret_cast<const char *>(name), kGnu, sizeof(kGnu)) == 0) {
+                return {reinterpret_cast<const char *>(desc), header->n_descsz};
+            }
+            cur = next;
+        }
+    }
+    return {};
+}
+
+uint64_t Elf::RelocationsLayout() const {
+    uint64_t hash = Fingerprint(&is_use_rela_, sizeof(is_use_rela_));
+    for (const auto &[rel, rel_size] : {std::pair{rel_plt_, rel_plt_size_},
+                                        std::pair{rel_dyn_, rel_dyn_size_},
+                                        std::pair{rel_android_, rel_android_size_}}) {
+        const uintptr_t table[] = {rel ? rel - bias_addr_ : 0, static_cast<uintptr_t>(rel_size)};
+        hash = Fingerprint(table, sizeof(table), hash);
+    }
+    return hash;
+}
+
+bool Elf::MayBeSlot(uintptr_t addr) const {
+    if (!valid_ || addr % alignof(uintptr_t) != 0 || addr < bias_addr_) return false;
+    const auto vaddr = addr - bias_addr_;
+    return std::ranges::any_of(std::span(program_header_, program_header_count_),
+                               [vaddr](const auto &phdr) {
+                                   return phdr.p_type == PT_LOAD && (phdr.p_flags & PF_W) &&
+                                          vaddr >= phdr.p_vaddr &&
+                                          vaddr + sizeof(uintptr_t) <= phdr.p_vaddr + phdr.p_memsz;
+                               });
+}
+
+ElfFile::ElfFile(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    ElfW(Ehdr) header;
+    std::vector<ElfW(Phdr)> phdrs;
+    if (pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(header.e_ident, ELFMAG, SELFMAG) == 0 &&
+        header.e_phentsize == sizeof(ElfW(Phdr))) {
+        phdrs.resize(header.e_phnum);
+        auto size = static_cast<ssize_t>(phdrs.size() * sizeof(ElfW(Phdr)));
+        if (pread(fd, phdrs.data(), size, header.e_phoff) != size) phdrs.clear();
+    }
+
+    // the image spans all PT_LOADs and starts where file offset 0, and thus the header, goes
+    const uintptr_t page_size = getpagesize();
+    auto page_start = [page_size](uintptr_t addr) { return addr & ~(page_size - 1); };
+    uintptr_t min_vaddr = UINTPTR_MAX;
+    uintptr_t max_vaddr = 0;
+    bool has_header = false;
+    for (const auto &phdr : phdrs) {
+        if (phdr.p_type != PT_LOAD) continue;
+        min_vaddr = std::min<uintptr_t>(min_vaddr, page_start(phdr.p_vaddr));
+        max_vaddr = std::max<uintptr_t>(max_vaddr, phdr.p_vaddr + phdr.p_filesz);
+        has_header = has_header || phdr.p_offset == 0;
+    }
+    if (!has_header || min_vaddr >= max_vaddr) {
+        close(fd);
+        return;
+    }
+
+    image_size_ = page_start(max_vaddr + page_size - 1) - min_vaddr;
+    auto *image = mmap(nullptr, image_size_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (image == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+    image_ = reinterpret_cast<uintptr_t>(image);
+    uintptr_t header_addr = 0;
+    for (const auto &phdr : phdrs) {
+        if (phdr.p_type != PT_LOAD || phdr.p_filesz == 0) continue;
+        auto offset = page_start(phdr.p_offset);
+        auto addr = image_ + page_start(phdr.p_vaddr) - min_vaddr;
+        if (mmap(reinterpret_cast<void *>(addr), phdr.p_offset + phdr.p_filesz - offset,
+                 PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, static_cast<off_t>(offset)) ==
+            MAP_FAILED) {
+            close(fd);
+            return;
+        }
+        if (phdr.p_offset == 0) header_addr = addr + phdr.p_vaddr - page_start(phdr.p_vaddr);
+    }
+    close(fd);
+    if (header_addr) elf_.emplace(header_addr);
+}
+
+ElfFile::~ElfFile() {
+    if (image_) munmap(reinterpret_cast<void *>(image_), image_size_);
+}
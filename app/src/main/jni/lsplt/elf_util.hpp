@@ -1,15 +1,35 @@
 #pragma once
 #include <link.h>
 #include <stdint.h>
+#include <optional>
+#include <span>
 #include <string_view>
 #include <vector>
 
+#include "include/lsplt.hpp"
+
+// A symbol name together with both of its ELF hashes, which are computed once rather than on
+// every lookup, or at compile time for an lsplt::Symbol.
+struct SymbolKey {
+    std::string_view name;
+    uint32_t gnu_hash;
+    uint32_t elf_hash;
+
+    SymbolKey(std::string_view name)
+        : name(name),
+          gnu_hash(lsplt::Symbol::GnuHash(name)),
+          elf_hash(lsplt::Symbol::ElfHash(name)) {}
+    SymbolKey(const lsplt::Symbol &symbol)
+        : name(symbol.name()), gnu_hash(symbol.gnu_hash()), elf_hash(symbol.elf_hash()) {}
+};
+
 class Elf {
     ElfW(Addr) base_addr_ = 0;
     ElfW(Addr) bias_addr_ = 0;
 
     ElfW(Ehdr) *header_ = nullptr;
     ElfW(Phdr) *program_header_ = nullptr;
+    size_t program_header_count_ = 0;
 
     ElfW(Dyn) *dynamic_ = nullptr;  //.dynamic
     ElfW(Word) dynamic_size_ = 0;
@@ -25,6 +45,7 @@ class Elf {
 
     ElfW(Addr) rel_android_ = 0;  // android compressed rel or rela
     ElfW(Word) rel_android_size_ = 0;
+    bool is_android_rela_ = false;
 
     // for ELF hash
     uint32_t *bucket_ = nullptr;
@@ -40,11 +61,70 @@ class Elf {
     bool is_use_rela_ = false;
     bool valid_ = false;
 
-    uint32_t GnuLookup(std::string_view name) const;
-    uint32_t ElfLookup(std::string_view name) const;
-    uint32_t LinearLookup(std::string_view name) const;
+    // imports sit below sym_offset_ and are not in the GNU hash table, so they get an open
+    // addressing table of their own, built once more than a few are looked up
+    struct ImportSlot {
+        uint32_t hash;
+        uint32_t idx;
+    };
+    mutable std::vector<ImportSlot> import_index_;
+    mutable size_t import_scans_ = 0;
+
+    // GOT slots of every symbol in CSR form, those of symbol idx are
+    // reloc_slots_[reloc_offsets_[idx], reloc_offsets_[idx + 1]), built once a second symbol is
+    // looked up
+    mutable std::vector<uint32_t> reloc_offsets_;
+    mutable std::vector<uintptr_t> reloc_slots_;
+    mutable bool relocs_scanned_ = false;
+
+    void ParseDynamic();
+    uint32_t GnuLookup(const SymbolKey &symbol) const;
+    uint32_t ElfLookup(const SymbolKey &symbol) const;
+    uint32_t ImportLookup(std::string_view name, size_t pending) const;
+    template <typename Visitor>
+    void ForEachSlot(std::span<const uint32_t> symbols, Visitor &&visitor) const;
+    void BuildRelocIndex() const;
 public:
-    std::vector<uintptr_t> FindPltAddr(std::string_view name) const;
+    std::vector<uintptr_t> FindPltAddr(std::string_view name) const {
+        return FindPltAddr(SymbolKey{name});
+    }
+    std::vector<uintptr_t> FindPltAddr(const SymbolKey &symbol) const;
+    // resolves all names together, with at most one pass over the relocations
+    std::vector<std::vector<uintptr_t>> FindPltAddr(std::span<const SymbolKey> names) const;
+    // whether the symbol is undefined here, i.e. imported from another library, with pending
+    // more lookups to come as for ImportLookup
+    bool Imports(const SymbolKey &symbol, size_t pending = 0) const;
     Elf(uintptr_t base_addr);
+    // the load bias of the image whose ELF header is at base_addr, from its program headers
+    // alone, or 0 if it is not a valid image for this machine
+    static uintptr_t LoadBias(uintptr_t base_addr);
+    // for a module reported by dl_iterate_phdr, whose header needs no probing
+    Elf(uintptr_t base_addr, uintptr_t bias_addr, const ElfW(Phdr) * phdr, size_t phnum);
     bool Valid() const { return valid_; };
+    uintptr_t Base() const { return base_addr_; }
+    uintptr_t Bias() const { return bias_addr_; }
+    // the NT_GNU_BUILD_ID note, or empty if the library has none
+    std::string_view BuildId() const;
+    // a fingerprint of where the relocation tables lie and how large they are, as the dynamic
+    // section tells, which GOT slots found earlier are only trusted for
+    uint64_t RelocationsLayout() const;
+    // whether addr can be a GOT slot: pointer aligned and in a writable PT_LOAD
+    bool MayBeSlot(uintptr_t addr) const;
+};
+
+// A library file mapped read-only the way the linker lays it out, every PT_LOAD at its virtual
+// address, so that Elf can analyse it without loading, and thus running, it.
+class ElfFile {
+    uintptr_t image_ = 0;
+    size_t image_size_ = 0;
+    std::optional<Elf> elf_;
+
+public:
+    explicit ElfFile(const char *path);
+    ~ElfFile();
+    ElfFile(const ElfFile &) = delete;
+    ElfFile &operator=(const ElfFile &) = delete;
+
+    bool Valid() const { return elf_ && elf_->Valid(); }
+    const Elf &Get() const { return *elf_; }
 };
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// A 64-bit fingerprint of data, to tell whether it changed. It takes a word per multiply, so
+// hashing a relocation table or a cache file costs about as much as reading it, and is not meant
+// to resist anyone crafting collisions.
+inline uint64_t Fingerprint(const void *data, size_t size, uint64_t hash = 0xcbf29ce484222325) {
+    constexpr uint64_t kPrime = 0x100000001b3;
+    const auto *cur = static_cast<const unsigned char *>(data);
+    for (; size >= sizeof(uint64_t); cur += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, cur, sizeof(word));
+        hash = std::rotl((hash ^ word) * kPrime, 31);
+    }
+    for (; size > 0; ++cur, --size) hash = std::rotl((hash ^ *cur) * kPrime, 31);
+    return hash;
+}
@@ -2,14 +2,45 @@
 
 #include <sys/types.h>
 
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <span>
 #include <string>
 #include <string_view>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 /// \namespace lsplt
 namespace lsplt {
 inline namespace v2 {
 
+/// \struct MapEntry
+/// \brief A non-owning view of a line in /proc/self/maps. It is passed to the visitor of
+/// #MapInfo::ForEach() and is only valid during that call.
+struct MapEntry {
+    /// \brief The start address of the memory region.
+    uintptr_t start;
+    /// \brief The end address of the memory region.
+    uintptr_t end;
+    /// \brief The permissions of the memory region, a bit mask of PROT_READ, PROT_WRITE and
+    /// PROT_EXEC.
+    uint8_t perms;
+    /// \brief Whether the memory region is private.
+    bool is_private;
+    /// \brief The offset of the memory region.
+    uintptr_t offset;
+    /// \brief The device number of the memory region.
+    dev_t dev;
+    /// \brief The inode number of the memory region.
+    ino_t inode;
+    /// \brief The path of the memory region. It points into the scanner's buffer.
+    std::string_view path;
+};
+
 /// \struct MapInfo
 /// \brief An entry that describes a line in /proc/self/maps. You can obtain a list of these entries
 /// by calling #Scan().
@@ -40,7 +71,179 @@ struct MapInfo {
     /// This is useful to find out the inode of the library to hook.
     /// \param[in] pid The process id to scan. This is "self" by default.
     /// \return A list of \ref MapInfo entries.
+    /// \note This is a thin wrapper of #ForEach() which copies every entry.
     [[maybe_unused, gnu::visibility("default")]] static std::vector<MapInfo> Scan(std::string_view pid = "self");
+
+    /// \brief Streams /proc/self/maps entry by entry without allocating per entry.
+    /// \param[in] pid The process id to scan.
+    /// \param[in] visitor The function called with each \ref MapEntry. It returns false to stop
+    /// the scan early.
+    /// \param[in] data The opaque pointer passed to \p visitor.
+    /// \return Whether the maps file can be read.
+    [[maybe_unused, gnu::visibility("default")]] static bool ForEach(std::string_view pid,
+                                                                     bool (*visitor)(const MapEntry &, void *),
+                                                                     void *data);
+
+    /// \brief Streams /proc/self/maps entry by entry without allocating per entry.
+    /// \param[in] pid The process id to scan.
+    /// \param[in] visitor A callable taking a `const` \ref MapEntry &. If it returns bool,
+    /// returning false stops the scan early.
+    /// \return Whether the maps file can be read.
+    template <typename Visitor>
+    static bool ForEach(std::string_view pid, Visitor &&visitor) {
+        return ForEach(
+            pid,
+            [](const MapEntry &entry, void *data) {
+                auto &func = *static_cast<std::remove_reference_t<Visitor> *>(data);
+                if constexpr (std::is_void_v<std::invoke_result_t<Visitor &, const MapEntry &>>) {
+                    func(entry);
+                    return true;
+                } else {
+                    return static_cast<bool>(func(entry));
+                }
+            },
+            const_cast<void *>(static_cast<const void *>(std::addressof(visitor))));
+    }
+};
+
+/// \class MapTable
+/// \brief A compact snapshot of /proc/self/maps stored column by column. Paths are interned, so
+/// the segments of a library share one copy of its path, and address lookups are binary searches
+/// over the sorted start addresses. You can obtain a table by calling #Scan().
+class MapTable {
+public:
+    /// \brief The value returned by #Find() when no memory region holds the address.
+    static constexpr size_t npos = std::numeric_limits<size_t>::max();
+
+    /// \brief Scans /proc/self/maps into a new table.
+    /// \param[in] pid The process id to scan. This is "self" by default.
+    /// \return The table, which is empty if the maps file cannot be read.
+    [[maybe_unused, gnu::visibility("default")]] static MapTable Scan(std::string_view pid = "self");
+
+    /// \brief Scans /proc/<pid>/maps of many processes on a small worker pool.
+    /// \param[in] pids The processes to scan.
+    /// \param[in] callback The function called with each pid and its table.
+    /// \param[in] data The opaque pointer passed to \p callback.
+    /// \param[in] workers The number of threads to scan with, the calling thread included. 0
+    /// picks a small default based on the number of CPUs.
+    /// \note Processes that exit before or during their scan, or have no memory mapping at all,
+    /// are skipped without calling \p callback.
+    /// \note \p callback is never called concurrently, but may be called from any of the workers
+    /// and in any order of \p pids. It returns before this function does.
+    [[maybe_unused, gnu::visibility("default")]] static void ScanMany(
+        std::span<const pid_t> pids, void (*callback)(pid_t, const MapTable &, void *), void *data,
+        size_t workers = 0);
+
+    /// \brief Scans /proc/<pid>/maps of many processes on a small worker pool.
+    /// \param[in] pids The processes to scan.
+    /// \param[in] callback A callable taking a pid_t and a `const` \ref MapTable &.
+    /// \param[in] workers The number of threads to scan with, the calling thread included.
+    /// \see #ScanMany(std::span<const pid_t>, void (*)(pid_t, const MapTable &, void *), void *,
+    /// size_t)
+    template <typename Callback>
+    static void ScanMany(std::span<const pid_t> pids, Callback &&callback, size_t workers = 0) {
+        ScanMany(
+            pids,
+            [](pid_t pid, const MapTable &table, void *data) {
+                (*static_cast<std::remove_reference_t<Callback> *>(data))(pid, table);
+            },
+            const_cast<void *>(static_cast<const void *>(std::addressof(callback))), workers);
+    }
+
+    /// \brief The number of memory regions in the table.
+    [[nodiscard]] size_t size() const { return starts_.size(); }
+    /// \brief Whether the table holds no memory region.
+    [[nodiscard]] bool empty() const { return starts_.empty(); }
+    /// \brief Returns the memory region at \p idx, whose path points into this table.
+    [[nodiscard]] MapEntry operator[](size_t idx) const {
+        return {starts_[idx],
+                ends_[idx],
+                static_cast<uint8_t>(perms_[idx] & ~kPrivate),
+                (perms_[idx] & kPrivate) != 0,
+                offsets_[idx],
+                devs_[idx],
+                inodes_[idx],
+                {paths_.data() + path_offsets_[path_ids_[idx]],
+                 path_offsets_[path_ids_[idx] + 1] - path_offsets_[path_ids_[idx]]}};
+    }
+
+    /// \brief Finds the memory region that holds \p addr.
+    /// \return The index of the memory region, or #npos if none holds it.
+    [[maybe_unused, gnu::visibility("default")]] size_t Find(uintptr_t addr) const;
+
+    /// \brief Finds the memory regions that hold each of \p addrs.
+    /// \param[in] addrs The addresses to look up.
+    /// \param[out] indices The index of the memory region for each address, or #npos. It must be
+    /// at least as long as \p addrs.
+    /// \note Addresses in ascending order are resolved by walking forward from the previous
+    /// result, so sorting them first makes a large batch cheaper.
+    [[maybe_unused, gnu::visibility("default")]] void FindMany(std::span<const uintptr_t> addrs,
+                                                               std::span<size_t> indices) const;
+
+private:
+    static constexpr uint8_t kPrivate = 0x80;
+
+    static bool Scan(std::string_view pid, MapTable &table);
+
+    std::vector<uintptr_t> starts_;
+    std::vector<uintptr_t> ends_;
+    std::vector<uintptr_t> offsets_;
+    std::vector<dev_t> devs_;
+    std::vector<ino_t> inodes_;
+    std::vector<uint8_t> perms_;
+    std::vector<uint32_t> path_ids_;
+    std::vector<uint32_t> path_offsets_;
+    std::string paths_;
+};
+
+/// \class Symbol
+/// \brief A function symbol whose name is a string literal, hashed at compile time. Passing it to
+/// #RegisterHook() saves hashing the name on every lookup and copying it at registration.
+/// \note It can only be constructed from a string literal in a constant expression, e.g.
+/// `lsplt::Symbol{"capset"}`, so the name always outlives the registration.
+class Symbol {
+public:
+    /// \brief Hashes \p name at compile time.
+    /// \param[in] name The function symbol, which must not contain a null character.
+    template <size_t N>
+    consteval explicit Symbol(const char (&name)[N])
+        : name_(name, N - 1), gnu_hash_(GnuHash(name_)), elf_hash_(ElfHash(name_)) {
+        // not a constant expression, so an invalid name fails to compile
+        if (name[N - 1] != '\0' || name_.find('\0') != std::string_view::npos) std::abort();
+    }
+
+    /// \brief The name of the symbol, which is null terminated.
+    [[nodiscard]] constexpr std::string_view name() const { return name_; }
+    /// \brief The length of the name of the symbol.
+    [[nodiscard]] constexpr size_t size() const { return name_.size(); }
+    /// \brief The hash of the name used by the DT_GNU_HASH table.
+    [[nodiscard]] constexpr uint32_t gnu_hash() const { return gnu_hash_; }
+    /// \brief The hash of the name used by the DT_HASH table.
+    [[nodiscard]] constexpr uint32_t elf_hash() const { return elf_hash_; }
+
+    /// \brief Computes the DJB hash of \p name used by the DT_GNU_HASH table.
+    static constexpr uint32_t GnuHash(std::string_view name) {
+        uint32_t hash = 5381;
+        for (unsigned char chr : name) hash += (hash << 5) + chr;
+        return hash;
+    }
+
+    /// \brief Computes the SysV hash of \p name used by the DT_HASH table.
+    static constexpr uint32_t ElfHash(std::string_view name) {
+        uint32_t hash = 0;
+        for (unsigned char chr : name) {
+            hash = (hash << 4) + chr;
+            auto high = hash & 0xf0000000;
+            hash ^= high;
+            hash ^= high >> 24;
+        }
+        return hash;
+    }
+
+private:
+    std::string_view name_;
+    uint32_t gnu_hash_;
+    uint32_t elf_hash_;
 };
 
 /// \brief Register a hook to a function by inode. For so within an archive, you should use
@@ -91,7 +294,7 @@ struct MapInfo {
 /// can invalidate this behaviour and hook the original memory region by calling
 /// #InvalidateBackup().
 /// \note You can get the offset range of the library by getting its entry offset and size in the
-/// zip file.
+/// zip file, e.g. by #FindApkLibrary().
 /// \note According to the Android linker specification, the \p offset must be page aligned.
 /// \note The \p offset must be accurate, otherwise the hook may fail because the ELF header
 /// cannot be found.
@@ -104,15 +307,373 @@ struct MapInfo {
 [[maybe_unused, gnu::visibility("default")]] bool RegisterHook(dev_t dev, ino_t inode, uintptr_t offset,
                                                                size_t size, std::string_view symbol,
                                                                void *callback, void **backup);
+
+/// \brief Register a hook to a function by inode, with a symbol hashed at compile time.
+/// \param[in] dev The device number of the memory region.
+/// \param[in] inode The inode of the library to hook.
+/// \param[in] symbol The function symbol to hook, e.g. `lsplt::Symbol{"capset"}`.
+/// \param[in] callback The callback function pointer to call when the function is called.
+/// \param[out] backup The backup function pointer which can call the original function. This is
+/// optional.
+/// \return Whether the hook is successfully registered.
+/// \note This behaves like #RegisterHook(dev_t, ino_t, std::string_view, void *, void **), but
+/// neither copies nor hashes the name.
+/// \see #CommitHook()
+[[maybe_unused, gnu::visibility("default")]] bool RegisterHook(dev_t dev, ino_t inode, Symbol symbol,
+                                                               void *callback, void **backup);
+
+/// \brief Register a hook to a function by inode with offset range, with a symbol hashed at
+/// compile time.
+/// \param[in] dev The device number of the memory region.
+/// \param[in] inode The inode of the library to hook.
+/// \param[in] offset The offset to the library in the file.
+/// \param[in] size The upper bound size to the library in the file.
+/// \param[in] symbol The function symbol to hook, e.g. `lsplt::Symbol{"capset"}`.
+/// \param[in] callback The callback function pointer to call when the function is called.
+/// \param[out] backup The backup function pointer which can call the original function. This is
+/// optional.
+/// \return Whether the hook is successfully registered.
+/// \note This behaves like
+/// #RegisterHook(dev_t, ino_t, uintptr_t, size_t, std::string_view, void *, void **), but neither
+/// copies nor hashes the name.
+/// \see #CommitHook()
+[[maybe_unused, gnu::visibility("default")]] bool RegisterHook(dev_t dev, ino_t inode, uintptr_t offset,
+                                                               size_t size, Symbol symbol,
+                                                               void *callback, void **backup);
+
+/// \struct HookSpec
+/// \brief One hook passed to #RegisterHooks(), with the same meaning as the corresponding
+/// arguments of #RegisterHook().
+struct HookSpec {
+    /// \brief The function symbol to hook.
+    std::string_view symbol;
+    /// \brief The callback function pointer to call when the function is called.
+    void *callback;
+    /// \brief The backup function pointer which can call the original function. This is optional.
+    void **backup;
+};
+
+/// \brief Register many hooks to functions of the same library by inode at once. At commit time,
+/// all symbols registered for a library are resolved together with a single pass over its
+/// relocations.
+/// \param[in] dev The device number of the memory region.
+/// \param[in] inode The inode of the library to hook.
+/// \param[in] hooks The hooks to register. The symbols are copied, so they only need to be valid
+/// during the call.
+/// \return Whether the hooks are successfully registered. If any of them is invalid, none of them
+/// is registered.
+/// \note This function is thread-safe.
+/// \note Each hook behaves like one registered by #RegisterHook().
+/// \see #RegisterHook(dev_t, ino_t, std::string_view, void *, void **)
+/// \see #CommitHook()
+[[maybe_unused, gnu::visibility("default")]] bool RegisterHooks(dev_t dev, ino_t inode,
+                                                                std::span<const HookSpec> hooks);
+
+/// \brief Register many hooks to functions of the same library by inode with offset range at once.
+/// \param[in] dev The device number of the memory region.
+/// \param[in] inode The inode of the library to hook.
+/// \param[in] offset The offset to the library in the file.
+/// \param[in] size The upper bound size to the library in the file.
+/// \param[in] hooks The hooks to register.
+/// \return Whether the hooks are successfully registered. If any of them is invalid, none of them
+/// is registered.
+/// \note This function is thread-safe.
+/// \note Each hook behaves like one registered by #RegisterHook() with the same offset range.
+/// \see #RegisterHook(dev_t, ino_t, uintptr_t, size_t, std::string_view, void *, void **)
+/// \see #CommitHook()
+[[maybe_unused, gnu::visibility("default")]] bool RegisterHooks(dev_t dev, ino_t inode,
+                                                                uintptr_t offset, size_t size,
+                                                                std::span<const HookSpec> hooks);
+
+/// \struct ApkLibrary
+/// \brief A library stored uncompressed in an APK, with the offset range that
+/// #RegisterHook(dev_t, ino_t, uintptr_t, size_t, std::string_view, void *, void **) takes.
+struct ApkLibrary {
+    /// \brief The device number of the APK, as `/proc/self/maps` lists it for its mappings.
+    dev_t dev;
+    /// \brief The inode of the APK, as `/proc/self/maps` lists it for its mappings.
+    ino_t inode;
+    /// \brief The offset of the library in the APK, which is page aligned.
+    uintptr_t offset;
+    /// \brief The size of the library.
+    size_t size;
+    /// \brief The name of its entry in the APK, e.g. `lib/arm64-v8a/libfoo.so`.
+    std::string path;
+};
+
+/// \brief Find a library that the linker can load directly from an APK, without the slow scans
+/// of the zip file on the Java side.
+/// \param[in] apk_path The path to the APK.
+/// \param[in] abi The ABI directory of the library, e.g. `arm64-v8a`.
+/// \param[in] name The file name of the library, e.g. `libfoo.so`.
+/// \return The library, or std::nullopt if the APK does not store it uncompressed and page
+/// aligned.
+/// \note This function is thread-safe.
+/// \note The APK is mapped and its central directory walked in place. What is found is cached by
+/// the device and inode of the APK, so later lookups only `stat()` it, and a changed APK is read
+/// again.
+/// \see #ListApkLibraries()
+[[maybe_unused, gnu::visibility("default")]] std::optional<ApkLibrary> FindApkLibrary(
+    std::string_view apk_path, std::string_view abi, std::string_view name);
+
+/// \brief List the libraries that the linker can load directly from an APK.
+/// \param[in] apk_path The path to the APK.
+/// \param[in] abi The ABI directory to list, e.g. `arm64-v8a`. An empty ABI lists them all.
+/// \return The libraries sorted by path, empty if the APK cannot be read.
+/// \note This function is thread-safe.
+/// \see #FindApkLibrary()
+[[maybe_unused, gnu::visibility("default")]] std::vector<ApkLibrary> ListApkLibraries(
+    std::string_view apk_path, std::string_view abi = {});
+
+/// \brief Register a hook to a function in every loaded library that imports it, instead of
+/// finding each library and registering it one by one.
+/// \param[in] path_glob The pattern, as of fnmatch(3), that the path of a library must match to
+/// be hooked. An empty pattern matches every library.
+/// \param[in] symbol The function symbol to hook.
+/// \param[in] callback The callback function pointer to call when the function is called.
+/// \param[out] backup The backup function pointer which can call the original function. This is
+/// optional. It is set once for every library hooked, which usually all import the same function.
+/// \return Whether the hook is successfully registered.
+/// \note This function is thread-safe.
+/// \note The libraries are looked up by the next #CommitHook(), with a single pass over all of
+/// them that checks the import table of each. Libraries loaded later are hooked by the
+/// #CommitHook() after their load, which only checks those, or as they are loaded with
+/// #SetAutoHook().
+/// \note Libraries that do not import \p symbol, and the library of LSPlt itself, are skipped.
+/// \see #CommitHook()
+[[maybe_unused, gnu::visibility("default")]] bool RegisterHookAll(std::string_view path_glob,
+                                                                  std::string_view symbol,
+                                                                  void *callback, void **backup);
+
+/// \brief Register a hook to a function in every loaded library that imports it, with a symbol
+/// hashed at compile time.
+/// \param[in] path_glob The pattern, as of fnmatch(3), that the path of a library must match to
+/// be hooked. An empty pattern matches every library.
+/// \param[in] symbol The function symbol to hook, e.g. `lsplt::Symbol{"capset"}`.
+/// \param[in] callback The callback function pointer to call when the function is called.
+/// \param[out] backup The backup function pointer which can call the original function. This is
+/// optional.
+/// \return Whether the hook is successfully registered.
+/// \see #RegisterHookAll(std::string_view, std::string_view, void *, void **)
+[[maybe_unused, gnu::visibility("default")]] bool RegisterHookAll(std::string_view path_glob,
+                                                                  Symbol symbol, void *callback,
+                                                                  void **backup);
+
+/// \brief Register many hooks to functions in every loaded library that imports them at once.
+/// \param[in] path_glob The pattern, as of fnmatch(3), that the path of a library must match to
+/// be hooked. An empty pattern matches every library.
+/// \param[in] hooks The hooks to register. The symbols are copied, so they only need to be valid
+/// during the call.
+/// \return Whether the hooks are successfully registered. If any of them is invalid, none of them
+/// is registered.
+/// \see #RegisterHookAll(std::string_view, std::string_view, void *, void **)
+[[maybe_unused, gnu::visibility("default")]] bool RegisterHookAll(std::string_view path_glob,
+                                                                  std::span<const HookSpec> hooks);
+
+/// \brief Enable or disable hooking libraries as soon as they are loaded. When enabled, LSPlt
+/// hooks `dlopen` and `android_dlopen_ext` in every library that imports them, and after each
+/// successful load applies the hooks of #RegisterHookAll(), and those registered for a library
+/// that was not loaded yet, to the new libraries only.
+/// \param[in] enable Whether to hook libraries as they are loaded.
+/// \return Whether the mode is successfully changed. Enabling it commits like #CommitHook() and
+/// fails if that fails.
+/// \note This function is thread-safe.
+/// \note Only the mappings of the new libraries are scanned, so the cost of a load does not
+/// depend on how much else is mapped.
+/// \note Disabling it leaves `dlopen` hooked, loads just stop triggering hooks. Enabling it again
+/// hooks the libraries loaded in between.
+/// \note A load never waits for another LSPlt call in progress, as it may hold the linker's lock.
+/// Its libraries are hooked by that call once it is done instead.
+/// \note Libraries loaded by LSPlt's own library, or with `dlopen` resolved by `dlsym()`, are only
+/// hooked at the next load through a hooked `dlopen` or #CommitHook().
+/// \see #RegisterHookAll()
+[[maybe_unused, gnu::visibility("default")]] bool SetAutoHook(bool enable);
+
+/// \brief Use a cache file of hook plans shared between processes. For every library, keyed by
+/// its device, inode and build ID, it holds the GOT slots of the symbols looked up in it as
+/// offsets from the load bias, so a later process hooking the same symbols patches them without
+/// scanning the relocations of the library again. Slots resolved by a commit are added to it.
+/// \param[in] path The cache file, which does not need to exist yet. An empty path stops using a
+/// cache.
+/// \return Whether the cache is usable. An invalid file is ignored, and replaced once new slots
+/// are saved.
+/// \note This function is thread-safe.
+/// \note The file is replaced by writing a new one next to it and renaming it, so its directory
+/// must be writable to save to it.
+/// \note Libraries without a build ID are never cached. Slots are only used while the
+/// relocation tables of the library lie where they did when the slots were found, and only if
+/// they lie in its writable segments.
+/// \see #PrecomputePlan()
+[[maybe_unused, gnu::visibility("default")]] bool SetPlanCache(std::string_view path);
+
+/// \brief Add the GOT slots of symbols in a library file to a plan cache without loading the
+/// library, e.g. ahead of time for the system libraries every process hooks.
+/// \param[in] cache_path The cache file, as for #SetPlanCache().
+/// \param[in] library_path The library, which is identified by the device and inode that
+/// `/proc/self/maps` lists for it once mapped, as for loaded libraries. A library inside an APK
+/// cannot be precomputed this way.
+/// \param[in] symbols The symbols to look up.
+/// \return Whether the slots are successfully saved. It fails for a library without a build ID.
+/// \note This function is thread-safe.
+/// \see #SetPlanCache()
+[[maybe_unused, gnu::visibility("default")]] bool PrecomputePlan(
+    std::string_view cache_path, std::string_view library_path,
+    std::span<const std::string_view> symbols);
+
 /// \brief Commit all registered hooks.
 /// \return Whether all hooks are successfully committed. If any of the hooks fail to commit,
 /// the result is false.
 /// \note This function is thread-safe.
 /// \note The return value indicates whether all hooks are successfully committed. You can
 /// determine which hook fails by checking the backup function pointer of #RegisterHook().
+/// \note Concurrent calls are combined: one thread commits everything registered before it
+/// started on behalf of all others, which wait for its result instead of scanning again.
 /// \see #RegisterHook()
 [[maybe_unused, gnu::visibility("default")]] bool CommitHook();
 
+/// \struct PlannedSlot
+/// \brief A GOT slot that #CommitHook() would write.
+struct PlannedSlot {
+    /// \brief The address of the slot.
+    uintptr_t addr;
+    /// \brief The symbol it was registered for.
+    std::string symbol;
+    /// \brief The value it would be set to.
+    void *callback;
+};
+
+/// \struct PlannedRegion
+/// \brief What #CommitHook() would do to one mapping of a library.
+struct PlannedRegion {
+    /// \brief The mapping.
+    MapInfo map;
+    /// \brief The slots it would write, in the order it would write them.
+    std::vector<PlannedSlot> slots;
+    /// \brief The pages that would be copied to private anonymous memory before writing.
+    std::vector<uintptr_t> shadowed_pages;
+    /// \brief The shadowed pages left without a hook afterwards, which would get their file pages
+    /// back.
+    std::vector<uintptr_t> restored_pages;
+    /// \brief The bytes that would be copied, i.e. the size of #shadowed_pages.
+    size_t bytes_copied;
+    /// \brief The pages that would become private dirty memory: the shadowed pages, or for
+    /// LSPlt's own library, which is written in place, the pages holding the slots.
+    size_t dirty_pages;
+};
+
+/// \struct HookPlan
+/// \brief What #CommitHook() would do, as returned by #PlanHooks().
+struct HookPlan {
+    /// \brief The mappings that would be changed, sorted by address.
+    std::vector<PlannedRegion> regions;
+    /// \brief The number of slots over all regions.
+    size_t slots;
+    /// \brief The number of shadowed pages over all regions.
+    size_t shadowed_pages;
+    /// \brief The number of restored pages over all regions.
+    size_t restored_pages;
+    /// \brief The bytes copied over all regions.
+    size_t bytes_copied;
+    /// \brief The dirty pages over all regions.
+    size_t dirty_pages;
+    /// \brief Whether the commit would succeed as far as can be told without doing it. It would
+    /// fail if the maps cannot be read or a slot lies outside of every mapping.
+    bool complete;
+};
+
+/// \brief Plan what #CommitHook() would do without doing it. It scans, filters and resolves the
+/// registered hooks exactly like a commit, but neither writes any slot nor shadows any page.
+/// \return The plan, which is exact as long as nothing is registered, loaded or unloaded before
+/// the next commit.
+/// \note This function is thread-safe.
+/// \note Registrations are not consumed, the next #CommitHook() still applies them. Like a
+/// commit, it does take pending #RegisterHookAll() hooks in, and refreshes what LSPlt knows about
+/// the mappings.
+/// \see #CommitHook()
+[[maybe_unused, gnu::visibility("default")]] HookPlan PlanHooks();
+
+/// \struct HookHandle
+/// \brief Names the hooks #Unhook() removes: those of a symbol in a library, whether registered
+/// by #RegisterHook(), #RegisterHooks() or #RegisterHookAll().
+struct HookHandle {
+    /// \brief The device number of the library.
+    dev_t dev;
+    /// \brief The inode of the library.
+    ino_t inode;
+    /// \brief The hooked symbol.
+    std::string_view symbol;
+};
+
+/// \brief Remove committed hooks directly, without registering the original functions and
+/// committing again. Each slot gets back the value it had before it was first hooked, and a
+/// shadowed page left without any hook gets its file page back, pages shadowed together with a
+/// single remap.
+/// \param[in] handles The hooks to remove.
+/// \return Whether all of them are successfully removed.
+/// \note This function is thread-safe.
+/// \note The maps are only looked at when a library was unloaded since the last time, to drop
+/// the hooks of those that are gone without touching the memory they had. Otherwise the cost
+/// only depends on the hooked regions of the libraries.
+/// \note Committed registrations still waiting for their library to be loaded are dropped too,
+/// while #RegisterHookAll() hooks keep applying to libraries loaded later.
+/// \note Hooks made permanent by #InvalidateBackup() are kept.
+/// \see #UnhookAll()
+[[maybe_unused, gnu::visibility("default")]] bool Unhook(std::span<const HookHandle> handles);
+
+/// \brief Remove every hook, leaving each hooked region as it was before the first hook.
+/// \return Whether all hooks are successfully removed.
+/// \note This function is thread-safe.
+/// \note Committed registrations still waiting for their library and #RegisterHookAll() hooks
+/// are dropped, and #SetAutoHook() is disabled. Libraries unloaded since they were hooked are
+/// left alone. Hooks registered but not committed yet are kept
+/// for the next #CommitHook().
+/// \see #Unhook()
+[[maybe_unused, gnu::visibility("default")]] bool UnhookAll();
+
+/// \struct Stats
+/// \brief What LSPlt has done since it was loaded or #ResetStats() was last called.
+struct Stats {
+    /// \brief The scans of the memory maps, of all mappings or only of newly loaded libraries.
+    uint64_t scans;
+    /// \brief The mappings read by those scans.
+    uint64_t maps_parsed;
+    /// \brief The ELF images whose dynamic section was parsed.
+    uint64_t elfs_parsed;
+    /// \brief The symbols found through a GNU hash table.
+    uint64_t gnu_lookups;
+    /// \brief The symbols found through a SysV hash table.
+    uint64_t sysv_lookups;
+    /// \brief The imported symbols found outside of any hash table, by a linear search or, for a
+    /// library asked for many of them, through an index built by one.
+    uint64_t linear_lookups;
+    /// \brief The relocation entries walked through to find GOT slots.
+    uint64_t relocations_walked;
+    /// \brief The pages copied to private anonymous memory to be written.
+    uint64_t pages_shadowed;
+    /// \brief The bytes copied for those pages.
+    uint64_t bytes_copied;
+    /// \brief The time spent reading the memory maps, in nanoseconds.
+    uint64_t scan_ns;
+    /// \brief The time spent matching mappings against registrations, in nanoseconds.
+    uint64_t filter_ns;
+    /// \brief The time spent parsing libraries and resolving their GOT slots, in nanoseconds.
+    uint64_t analysis_ns;
+    /// \brief The time spent shadowing pages and writing slots, in nanoseconds.
+    uint64_t patch_ns;
+};
+
+/// \brief Get what LSPlt has done so far, e.g. to see where the time of #CommitHook() goes.
+/// \return The counters.
+/// \note This function is thread-safe. The counters are read one by one, so ones read while
+/// another thread commits may not add up.
+/// \note The counters are always kept, at the cost of an atomic add per event or per phase.
+/// \see #ResetStats()
+[[maybe_unused, gnu::visibility("default")]] Stats GetStats();
+
+/// \brief Reset the counters of #GetStats() to zero.
+/// \note This function is thread-safe.
+[[maybe_unused, gnu::visibility("default")]] void ResetStats();
+
 /// \brief Invalidate backup memory regions
 /// Normally LSPlt will backup the hooked memory region and do hook on a copied anonymous memory
 /// region, and restore the original memory region when the hook is unregistered
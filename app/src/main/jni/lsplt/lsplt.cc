@@ -1,21 +1,45 @@
 #include "include/lsplt.hpp"
 
+#include <fnmatch.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <link.h>
 #include <sys/mman.h>
-#include <sys/sysmacros.h>
+#include <sys/stat.h>
 
-#include <array>
+#include <algorithm>
+#include <atomic>
 #include <cinttypes>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <iterator>
 #include <list>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "elf_util.hpp"
 #include "logging.hpp"
+#include "maps_util.hpp"
+#include "parallel.hpp"
+#include "plan_cache.hpp"
+#include "stats.hpp"
 #include "syscall.hpp"
+#include "zip_util.hpp"
 
 namespace {
 const uintptr_t kPageSize = getpagesize();
+// spawning workers costs about as much as analysing a small library
+constexpr size_t kMinParallelLibraries = 4;
 
 inline auto PageStart(uintptr_t addr) {
     return reinterpret_cast<char *>(addr / kPageSize * kPageSize);
@@ -29,277 +53,1559 @@ struct RegisterInfo {
     dev_t dev;
     ino_t inode;
     std::pair<uintptr_t, uintptr_t> offset_range;
-    std::string symbol;
+    // owns the name of a symbol given at runtime, an lsplt::Symbol needs no copy
+    std::string name;
+    SymbolKey symbol;
     void *callback;
     void **backup;
 };
 
+// The list never moves its nodes, so the symbol can point into the name of its own entry.
+RegisterInfo &AddRegisterInfo(std::list<RegisterInfo> &register_info, dev_t dev, ino_t inode,
+                              std::pair<uintptr_t, uintptr_t> offset_range, std::string name,
+                              const SymbolKey &symbol, void *callback, void **backup) {
+    auto &info = register_info.emplace_back(dev, inode, offset_range, std::move(name), symbol,
+                                            callback, backup);
+    if (!info.name.empty()) info.symbol.name = info.name;
+    return info;
+}
+
+// A hook for every library that imports the symbol, see RegisterHookAll.
+struct WildcardInfo {
+    std::string path_glob;
+    std::string name;
+    SymbolKey symbol;
+    void *callback;
+    void **backup;
+};
+
+struct StringHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view str) const { return std::hash<std::string_view>{}(str); }
+};
+
+// A parsed library together with the GOT slots already resolved for its symbols. All of it only
+// depends on the file and its load bias, so it is shared by every scan that finds them again.
+struct ElfInfo {
+    Elf elf;
+    std::unordered_map<std::string, std::vector<uintptr_t>, StringHash, std::equal_to<>> slots;
+    // where slots found by earlier processes are taken from, and the symbols resolved here that
+    // it does not have yet
+    const PlanCache *plan_cache = nullptr;
+    dev_t dev = 0;
+    ino_t inode = 0;
+    std::string build_id;
+    uint64_t relocations = 0;
+    std::vector<std::string> unsaved;
+
+    const std::vector<uintptr_t> &FindPltAddr(const SymbolKey &symbol) {
+        if (auto iter = slots.find(symbol.name); iter != slots.end()) return iter->second;
+        if (const auto *addrs = FromPlanCache(symbol)) return *addrs;
+        if (plan_cache) unsaved.emplace_back(symbol.name);
+        return slots.emplace(symbol.name, elf.FindPltAddr(symbol)).first->second;
+    }
+
+    // resolves the symbols not seen before together, with a single pass over the relocations
+    void Resolve(std::span<const SymbolKey> symbols) {
+        std::vector<SymbolKey> missing;
+        for (const auto &symbol : symbols) {
+            if (!slots.contains(symbol.name) && !FromPlanCache(symbol)) {
+                missing.emplace_back(symbol);
+            }
+        }
+        if (missing.empty()) return;
+        auto found = elf.FindPltAddr(missing);
+        for (size_t i = 0; i < missing.size(); ++i) {
+            slots.emplace(missing[i].name, std::move(found[i]));
+            if (plan_cache) unsaved.emplace_back(missing[i].name);
+        }
+    }
+
+    void UsePlanCache(const PlanCache *cache, dev_t library_dev, ino_t library_inode) {
+        build_id = elf.BuildId();
+        if (build_id.empty()) return;
+        relocations = elf.RelocationsLayout();
+        plan_cache = cache;
+        dev = library_dev;
+        inode = library_inode;
+    }
+
+    // records the symbols resolved since the last call in the plan cache
+    bool Save(PlanCache &cache) {
+        if (unsaved.empty()) return false;
+        std::vector<uint64_t> offsets;
+        for (const auto &name : unsaved) {
+            offsets.clear();
+            for (auto addr : slots.find(name)->second) offsets.emplace_back(addr - elf.Bias());
+            cache.Record(dev, inode, build_id, relocations, name, offsets);
+        }
+        unsaved.clear();
+        return true;
+    }
+
+private:
+    const std::vector<uintptr_t> *FromPlanCache(const SymbolKey &symbol) {
+        if (!plan_cache) return nullptr;
+        auto offsets = plan_cache->Find(dev, inode, build_id, relocations, symbol.name);
+        if (!offsets) return nullptr;
+        std::vector<uintptr_t> addrs;
+        addrs.reserve(offsets->size());
+        for (auto offset : *offsets) {
+            // the tables lie where they did, but their contents are not compared
+            if (!elf.MayBeSlot(elf.Bias() + offset)) {
+                LOGW("Ignoring cached plan of %s with a slot outside of the GOT",
+                     symbol.name.data());
+                return nullptr;
+            }
+            addrs.emplace_back(elf.Bias() + offset);
+        }
+        return &slots.emplace(symbol.name, std::move(addrs)).first->second;
+    }
+};
+
 struct HookInfo : public lsplt::MapInfo {
     std::map<uintptr_t, uintptr_t> hooks;
-    uintptr_t backup;
-    std::unique_ptr<Elf> elf;
+    // shadowed page -> where its file page was moved to
+    std::map<uintptr_t, uintptr_t> backups;
+    std::shared_ptr<ElfInfo> elf;
     bool self;
-    [[nodiscard]] bool Match(const RegisterInfo &info) const {
-        return info.dev == dev && info.inode == inode && offset >= info.offset_range.first &&
-               offset < info.offset_range.second;
+};
+
+// Registrations bucketed by (dev, inode), each bucket sorted by the start of the offset range
+// while keeping the registration order among equal starts. Built once per commit, so matching a
+// mapping against all registrations is a single hash lookup and a binary search over the offset
+// ranges of the bucket, merged into disjoint ones.
+class RegisterIndex {
+public:
+    using Iterator = std::list<RegisterInfo>::iterator;
+
+private:
+    struct KeyHash {
+        size_t operator()(const std::pair<dev_t, ino_t> &key) const {
+            return std::hash<uint64_t>{}(static_cast<uint64_t>(key.first) * 0x9e3779b97f4a7c15 ^
+                                         static_cast<uint64_t>(key.second));
+        }
+    };
+
+    // each registration with the start of its offset range, which stays readable once the
+    // registration is taken and erased, so the buckets remain sorted by it
+    using Entry = std::pair<uintptr_t, Iterator>;
+    using Range = std::pair<uintptr_t, uintptr_t>;
+
+    struct Bucket {
+        std::vector<Entry> entries;
+        // the offset ranges of the registrations not taken yet, merged, sorted and rebuilt by
+        // the first match after some were taken
+        mutable std::vector<Range> ranges;
+        mutable bool stale = true;
+    };
+
+    std::unordered_map<std::pair<dev_t, ino_t>, Bucket, KeyHash> buckets_;
+    Iterator end_;
+
+    void Merge(const Bucket &bucket) const {
+        bucket.ranges.clear();
+        for (const auto &[start, iter] : bucket.entries) {
+            if (iter == end_) continue;
+            auto end = iter->offset_range.second;
+            if (!bucket.ranges.empty() && start <= bucket.ranges.back().second) {
+                bucket.ranges.back().second = std::max(bucket.ranges.back().second, end);
+            } else if (start < end) {
+                bucket.ranges.emplace_back(start, end);
+            }
+        }
+        bucket.stale = false;
+    }
+
+public:
+    explicit RegisterIndex(std::list<RegisterInfo> &register_info) : end_(register_info.end()) {
+        buckets_.reserve(register_info.size());
+        for (auto iter = register_info.begin(); iter != register_info.end(); ++iter) {
+            buckets_[{iter->dev, iter->inode}].entries.emplace_back(iter->offset_range.first,
+                                                                   iter);
+        }
+        for (auto &[_, bucket] : buckets_) {
+            std::ranges::stable_sort(bucket.entries, {}, &Entry::first);
+        }
+    }
+
+    [[nodiscard]] bool Contains(dev_t dev, ino_t inode) const {
+        return buckets_.contains({dev, inode});
+    }
+
+    // whether any registration covers a mapping of the file at offset
+    [[nodiscard]] bool Match(dev_t dev, ino_t inode, uintptr_t offset) const {
+        auto bucket = buckets_.find({dev, inode});
+        if (bucket == buckets_.end()) return false;
+        if (bucket->second.stale) Merge(bucket->second);
+        const auto &ranges = bucket->second.ranges;
+        auto range = std::ranges::upper_bound(ranges, offset, {}, &Range::first);
+        return range != ranges.begin() && offset < std::prev(range)->second;
+    }
+
+    // hands every registration whose offset range starts at offset, in registration order, to
+    // func and forgets it, as the caller erases it from the list
+    template <typename Func>
+    void TakeStartingAt(dev_t dev, ino_t inode, uintptr_t offset, Func &&func) {
+        auto bucket = buckets_.find({dev, inode});
+        if (bucket == buckets_.end()) return;
+        auto group = std::ranges::equal_range(bucket->second.entries, offset, {}, &Entry::first);
+        for (auto &[start, iter] : group) {
+            if (iter == end_ || offset >= iter->offset_range.second) continue;
+            func(std::exchange(iter, end_));
+            bucket->second.stale = true;
+        }
     }
 };
 
-class HookInfos : public std::map<uintptr_t, HookInfo, std::greater<>> {
+struct Module {
+    uintptr_t base;
+    uintptr_t bias;
+    const ElfW(Phdr) * phdr;
+    size_t phnum;
+};
+
+// Remembers what the last scan looked at. The linker bumps dlpi_adds/dlpi_subs on every load and
+// unload, so while they stay the same the hook infos are still exact for every registration that
+// scan saw, and the next commit can skip rescanning.
+class ScanCache {
 public:
-    static auto ScanHookInfo() {
-        static ino_t kSelfInode = 0;
-        static dev_t kSelfDev = 0;
-        HookInfos info;
-        auto maps = lsplt::MapInfo::Scan();
-        if (kSelfInode == 0) {
-            auto self = reinterpret_cast<uintptr_t>(__builtin_return_address(0));
-            for (auto &map : maps) {
-                if (self >= map.start && self < map.end) {
-                    kSelfInode = map.inode;
-                    kSelfDev = map.dev;
-                    LOGV("self inode = %lu", kSelfInode);
-                    break;
+    using Generation = std::pair<unsigned long long, unsigned long long>;
+
+private:
+    using Key = std::tuple<dev_t, ino_t, std::pair<uintptr_t, uintptr_t>>;
+
+    std::optional<Generation> generation_;
+    std::vector<Key> keys_;
+    std::vector<Module> modules_;
+
+    static constexpr auto kGenerationSize =
+        offsetof(dl_phdr_info, dlpi_subs) + sizeof(dl_phdr_info::dlpi_subs);
+
+public:
+    static std::optional<Generation> CurrentGeneration() {
+        std::optional<Generation> generation;
+        dl_iterate_phdr(
+            [](dl_phdr_info *info, size_t size, void *data) {
+                // counters are only reported by newer linkers
+                if (size >= kGenerationSize) {
+                    *static_cast<std::optional<Generation> *>(data) = {info->dlpi_adds,
+                                                                       info->dlpi_subs};
+                }
+                return 1;
+            },
+            &generation);
+        return generation;
+    }
+
+    [[nodiscard]] bool Covers(const std::list<RegisterInfo> &register_info) const {
+        if (!generation_ || generation_ != CurrentGeneration()) return false;
+        return std::all_of(register_info.begin(), register_info.end(), [this](const auto &reg) {
+            return std::binary_search(keys_.begin(), keys_.end(),
+                                      Key{reg.dev, reg.inode, reg.offset_range});
+        });
+    }
+
+    // must be called before scanning so that a concurrent load invalidates the result
+    void Reset(const std::list<RegisterInfo> &register_info) {
+        generation_.reset();
+        modules_.clear();
+        dl_iterate_phdr(
+            [](dl_phdr_info *info, size_t size, void *data) {
+                auto *self = static_cast<ScanCache *>(data);
+                if (size >= kGenerationSize && !self->generation_) {
+                    self->generation_ = {info->dlpi_adds, info->dlpi_subs};
+                }
+                auto base = std::numeric_limits<uintptr_t>::max();
+                for (size_t i = 0; i < info->dlpi_phnum; i++) {
+                    if (const auto &phdr = info->dlpi_phdr[i]; phdr.p_type == PT_LOAD) {
+                        base = std::min(base, info->dlpi_addr +
+                                                  reinterpret_cast<uintptr_t>(
+                                                      PageStart(phdr.p_vaddr)));
+                    }
+                }
+                if (base != std::numeric_limits<uintptr_t>::max()) {
+                    self->modules_.emplace_back(base, info->dlpi_addr, info->dlpi_phdr,
+                                                info->dlpi_phnum);
+                }
+                return 0;
+            },
+            this);
+        std::sort(modules_.begin(), modules_.end(),
+                  [](const auto &a, const auto &b) { return a.base < b.base; });
+        keys_.clear();
+        for (const auto &reg : register_info) {
+            keys_.emplace_back(reg.dev, reg.inode, reg.offset_range);
+        }
+        std::sort(keys_.begin(), keys_.end());
+    }
+
+    void Clear() { generation_.reset(); }
+
+    [[nodiscard]] const Module *FindModule(uintptr_t base) const {
+        auto iter = std::lower_bound(modules_.begin(), modules_.end(), base,
+                                     [](const auto &module, auto addr) { return module.base < addr; });
+        return iter != modules_.end() && iter->base == base ? &*iter : nullptr;
+    }
+};
+
+// Every library analysed so far, keyed by (dev, inode, load bias), so that a commit after a
+// rescan only pays for the symbols it has not resolved before. Get() may be called from the
+// analysis workers of a commit, and parses new libraries outside of the lock.
+class ElfCache {
+    using Key = std::tuple<dev_t, ino_t, uintptr_t>;
+    std::mutex mutex_;
+    std::map<Key, std::shared_ptr<ElfInfo>> entries_;
+    const PlanCache *plan_cache_ = nullptr;
+
+    template <typename Parse>
+    std::shared_ptr<ElfInfo> Get(const Key &key, Parse &&parse) {
+        {
+            const std::unique_lock lock(mutex_);
+            if (auto iter = entries_.find(key); iter != entries_.end()) return iter->second;
+        }
+        auto entry = std::make_shared<ElfInfo>(parse());
+        if (plan_cache_) entry->UsePlanCache(plan_cache_, std::get<0>(key), std::get<1>(key));
+        const std::unique_lock lock(mutex_);
+        return entries_.try_emplace(key, std::move(entry)).first->second;
+    }
+
+public:
+    [[nodiscard]] std::shared_ptr<ElfInfo> Get(dev_t dev, ino_t inode, const Module &module) {
+        return Get({dev, inode, module.bias}, [&module] {
+            return Elf{module.base, module.bias, module.phdr, module.phnum};
+        });
+    }
+
+    [[nodiscard]] std::shared_ptr<ElfInfo> Get(const HookInfo &info, const ScanCache &scan_cache) {
+        if (const auto *module = scan_cache.FindModule(info.start)) {
+            return Get(info.dev, info.inode, *module);
+        }
+        // the bias alone keys the cache, the dynamic section is only parsed on a miss
+        return Get({info.dev, info.inode, Elf::LoadBias(info.start)},
+                   [&info] { return Elf{info.start}; });
+    }
+
+    // drops libraries that are neither hooked nor loaded at the same place anymore
+    void Prune(const ScanCache &scan_cache) {
+        const std::unique_lock lock(mutex_);
+        std::erase_if(entries_, [&scan_cache](const auto &entry) {
+            const auto &[key, elf_info] = entry;
+            if (elf_info.use_count() > 1) return false;
+            const auto *module = scan_cache.FindModule(elf_info->elf.Base());
+            return !module || module->bias != std::get<2>(key);
+        });
+    }
+
+    // libraries parsed from now on look up and record their slots in the plan cache
+    void SetPlanCache(const PlanCache *plan_cache) { plan_cache_ = plan_cache; }
+
+    // records what was resolved since the last call, returning whether there was anything
+    bool Save(PlanCache &plan_cache) {
+        const std::unique_lock lock(mutex_);
+        bool saved = false;
+        for (auto &[key, elf_info] : entries_) {
+            if (elf_info->plan_cache == &plan_cache) saved = elf_info->Save(plan_cache) || saved;
+        }
+        return saved;
+    }
+};
+
+// The device and inode /proc/self/maps lists for the file mapped at addr, the way libraries are
+// identified everywhere else, as stat() may report another device for the same file.
+std::optional<std::pair<dev_t, ino_t>> FindFileOf(uintptr_t addr) {
+    std::optional<std::pair<dev_t, ino_t>> file;
+    if (std::optional<MapsQuery> query; MapsQuery::Supported() && query.emplace("self").Valid()) {
+        if (lsplt::MapEntry map; query->Query(addr, MapsQuery::kFileBacked, map)) {
+            file.emplace(map.dev, map.inode);
+        }
+    } else {
+        lsplt::MapInfo::ForEach("self", [&](const lsplt::MapEntry &map) {
+            if (addr >= map.start && addr < map.end && map.inode != 0) {
+                file.emplace(map.dev, map.inode);
+            }
+        });
+    }
+    return file;
+}
+
+// The libraries found in each APK looked up, keyed by (dev, inode). The size and modification
+// time are kept too, so that an APK written over in place is parsed again, as is the device and
+// inode /proc/self/maps lists for it, which its libraries are registered by.
+class ApkCache {
+    struct Entry {
+        off_t size;
+        timespec mtime;
+        std::pair<dev_t, ino_t> mapped;
+        std::shared_ptr<const ApkLibraries> libraries;
+    };
+    std::mutex mutex_;
+    std::map<std::pair<dev_t, ino_t>, Entry> entries_;
+
+    static bool Same(const Entry &entry, const struct stat &st) {
+        return entry.size == st.st_size && entry.mtime.tv_sec == st.st_mtim.tv_sec &&
+               entry.mtime.tv_nsec == st.st_mtim.tv_nsec;
+    }
+
+public:
+    // The libraries of the APK at path, with the device and inode of its mappings in mapped. An
+    // APK is parsed outside of the lock, so lookups in others do not wait for it.
+    std::shared_ptr<const ApkLibraries> Get(std::string_view path,
+                                            std::pair<dev_t, ino_t> &mapped) {
+        const std::string file{path};
+        struct stat st {};
+        if (stat(file.c_str(), &st) != 0) return nullptr;
+        const std::pair key{st.st_dev, st.st_ino};
+        {
+            const std::unique_lock lock(mutex_);
+            if (auto iter = entries_.find(key); iter != entries_.end() && Same(iter->second, st)) {
+                mapped = iter->second.mapped;
+                return iter->second.libraries;
+            }
+        }
+        int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return nullptr;
+        std::optional<std::pair<dev_t, ino_t>> found;
+        std::shared_ptr<const ApkLibraries> libraries;
+        if (fstat(fd, &st) == 0 && st.st_dev == key.first && st.st_ino == key.second) {
+            // stat() may report another device than the maps, e.g. on overlay or FUSE paths
+            if (auto *page = mmap(nullptr, kPageSize, PROT_READ, MAP_PRIVATE, fd, 0);
+                page != MAP_FAILED) {
+                found = FindFileOf(reinterpret_cast<uintptr_t>(page));
+                munmap(page, kPageSize);
+            }
+            if (auto parsed = found ? ApkLibraries::Parse(fd, st.st_size) : std::nullopt) {
+                libraries = std::make_shared<const ApkLibraries>(std::move(*parsed));
+            }
+        }
+        close(fd);
+        if (!libraries) return nullptr;
+        mapped = *found;
+        const std::unique_lock lock(mutex_);
+        entries_.insert_or_assign(key, Entry{st.st_size, st.st_mtim, mapped, libraries});
+        return libraries;
+    }
+};
+
+// A library loaded by the linker, together with the file mapped at its base once found.
+struct Library {
+    Module module{};
+    // the end of its last segment
+    uintptr_t end = 0;
+    // how much of the file is mapped from the ELF header on
+    uintptr_t size = 0;
+    // of the name the linker knows it by, telling apart libraries loaded at the same base
+    size_t name_hash = 0;
+    bool self = false;
+    dev_t dev = 0;
+    ino_t inode = 0;
+    uintptr_t offset = 0;
+    std::string path;
+
+    void SetFile(const lsplt::MapEntry &map) {
+        if (!map.is_private || map.path.empty() || map.path[0] == '[') return;
+        dev = map.dev;
+        inode = map.inode;
+        offset = map.offset;
+        path = map.path;
+    }
+};
+
+// Lists the libraries loaded by the linker sorted by base, without their files yet.
+std::vector<Library> LoadedLibraries() {
+    struct Context {
+        std::vector<Library> libraries;
+        uintptr_t self;
+    } context{{}, reinterpret_cast<uintptr_t>(&LoadedLibraries)};
+    dl_iterate_phdr(
+        [](dl_phdr_info *info, size_t, void *data) {
+            auto *context = static_cast<Context *>(data);
+            auto base = std::numeric_limits<uintptr_t>::max();
+            uintptr_t end = 0;
+            uintptr_t size = 0;
+            bool self = false;
+            for (size_t i = 0; i < info->dlpi_phnum; i++) {
+                const auto &phdr = info->dlpi_phdr[i];
+                if (phdr.p_type != PT_LOAD) continue;
+                auto start = info->dlpi_addr + phdr.p_vaddr;
+                base = std::min(base, reinterpret_cast<uintptr_t>(PageStart(start)));
+                end = std::max(end, start + phdr.p_memsz);
+                size = std::max(size, static_cast<uintptr_t>(phdr.p_offset + phdr.p_filesz));
+                self = self || (context->self >= start && context->self < start + phdr.p_memsz);
+            }
+            if (base != std::numeric_limits<uintptr_t>::max()) {
+                auto &library = context->libraries.emplace_back();
+                library.module = {base, info->dlpi_addr, info->dlpi_phdr, info->dlpi_phnum};
+                library.end = end;
+                library.size = size;
+                library.name_hash =
+                    std::hash<std::string_view>{}(info->dlpi_name ? info->dlpi_name : "");
+                library.self = self;
+            }
+            return 0;
+        },
+        &context);
+    auto &libraries = context.libraries;
+    std::sort(libraries.begin(), libraries.end(),
+              [](const auto &a, const auto &b) { return a.module.base < b.module.base; });
+    return std::move(libraries);
+}
+
+// Finds the file behind each library, with a query per library or one pass over the maps.
+void FindFiles(std::vector<Library> &libraries) {
+    const PhaseTimer timer(stats.scan_ns);
+    Count(stats.scans);
+    if (std::optional<MapsQuery> query; MapsQuery::Supported() && query.emplace("self").Valid()) {
+        for (auto &library : libraries) {
+            lsplt::MapEntry map;
+            if (library.self ||
+                !query->Query(library.module.base, MapsQuery::kFileBacked, map, true) ||
+                map.start != library.module.base) {
+                continue;
+            }
+            library.SetFile(map);
+        }
+    } else {
+        lsplt::MapInfo::ForEach("self", [&](const lsplt::MapEntry &map) {
+            auto iter = std::lower_bound(
+                libraries.begin(), libraries.end(), map.start,
+                [](const auto &library, auto addr) { return library.module.base < addr; });
+            if (iter != libraries.end() && iter->module.base == map.start && !iter->self) {
+                iter->SetFile(map);
+            }
+        });
+    }
+}
+
+// Remembers which libraries the committed wildcard hooks have seen, so that after a dlopen or
+// commit only the new ones are scanned and hooked. While the linker's load counter stays the
+// same, nothing is listed at all.
+class LoadWatcher {
+    using Key = std::pair<uintptr_t, size_t>;
+
+    std::optional<ScanCache::Generation> generation_;
+    // base and name hash of each library, as a library loaded where an unloaded one was is new
+    std::vector<Key> seen_;
+
+public:
+    std::vector<Library> NewLibraries() {
+        auto generation = ScanCache::CurrentGeneration();
+        if (generation && generation == generation_) return {};
+        generation_ = generation;
+        auto libraries = LoadedLibraries();
+        std::vector<Key> seen;
+        seen.reserve(libraries.size());
+        for (const auto &library : libraries) {
+            seen.emplace_back(library.module.base, library.name_hash);
+        }
+        std::erase_if(libraries, [this](const auto &library) {
+            return std::binary_search(seen_.begin(), seen_.end(),
+                                      Key{library.module.base, library.name_hash});
+        });
+        seen_ = std::move(seen);
+        return libraries;
+    }
+};
+
+// Turns the wildcard hooks into a registration for every given library whose path matches and
+// that imports the symbol, so the commit handles them like any other. The import table of each
+// library is checked through the cached Elf, on a few workers as it only reads the library. Our
+// own library is never hooked.
+void ExpandWildcards(const std::list<WildcardInfo> &wildcards,
+                     std::span<const Library> libraries, std::list<RegisterInfo> &register_info,
+                     ElfCache &elf_cache) {
+    const PhaseTimer timer(stats.analysis_ns);
+    std::vector<std::vector<const WildcardInfo *>> matches(libraries.size());
+    ParallelFor(libraries.size(),
+                libraries.size() < kMinParallelLibraries ? 1 : DefaultWorkers(), [&](size_t i) {
+                    const auto &library = libraries[i];
+                    if (library.self || library.inode == 0) return;
+                    std::shared_ptr<ElfInfo> elf;
+                    size_t pending = wildcards.size();
+                    for (const auto &wildcard : wildcards) {
+                        --pending;
+                        if (!wildcard.path_glob.empty() &&
+                            fnmatch(wildcard.path_glob.data(), library.path.data(), 0) != 0) {
+                            continue;
+                        }
+                        if (!elf) elf = elf_cache.Get(library.dev, library.inode, library.module);
+                        if (!elf->elf.Valid() || !elf->elf.Imports(wildcard.symbol, pending)) {
+                            continue;
+                        }
+                        matches[i].emplace_back(&wildcard);
+                    }
+                });
+    for (size_t i = 0; i < libraries.size(); ++i) {
+        const auto &library = libraries[i];
+        for (const auto *wildcard : matches[i]) {
+            LOGV("Match %s for %s", library.path.data(), wildcard->symbol.name.data());
+            AddRegisterInfo(register_info, library.dev, library.inode,
+                            std::pair{library.offset, library.offset + library.size}, {},
+                            wildcard->symbol, wildcard->callback, wildcard->backup);
+        }
+    }
+}
+
+// Hook infos as a flat index sorted by start address. Lookups only touch the start and end
+// columns, the rest of every region (path, hooks, backup, elf) sits in a parallel side table.
+class HookInfos {
+    std::vector<uintptr_t> starts_;
+    std::vector<uintptr_t> ends_;
+    std::vector<HookInfo> infos_;
+    // the linker's unload counter when every region was last found still loaded
+    std::optional<unsigned long long> checked_unloads_;
+
+    void Index() {
+        if (!std::is_sorted(infos_.begin(), infos_.end(),
+                            [](const auto &a, const auto &b) { return a.start < b.start; })) {
+            std::sort(infos_.begin(), infos_.end(),
+                      [](const auto &a, const auto &b) { return a.start < b.start; });
+        }
+        starts_.resize(infos_.size());
+        ends_.resize(infos_.size());
+        for (size_t i = 0; i < infos_.size(); ++i) {
+            starts_[i] = infos_[i].start;
+            ends_[i] = infos_[i].end;
+        }
+    }
+
+public:
+    static constexpr size_t npos = std::numeric_limits<size_t>::max();
+
+    [[nodiscard]] bool empty() const { return infos_.empty(); }
+
+    // index of the region holding addr, or npos
+    [[nodiscard]] size_t Find(uintptr_t addr) const {
+        const auto *base = starts_.data();
+        auto len = starts_.size();
+        if (len == 0 || addr < base[0]) return npos;
+        // branchless search for the last start not above addr
+        while (len > 1) {
+            auto half = len / 2;
+            base = base[half] <= addr ? base + half : base;
+            len -= half;
+        }
+        auto idx = static_cast<size_t>(base - starts_.data());
+        return addr < ends_[idx] ? idx : npos;
+    }
+
+    // Find for each of addrs. The slots of a symbol mostly come in ascending order, so each one
+    // is looked for by galloping forward from the region of the previous one; only an address
+    // below its predecessor is searched for from scratch.
+    void FindMany(std::span<const uintptr_t> addrs, std::span<size_t> indices) const {
+        const auto size = starts_.size();
+        size_t hint = 0;
+        uintptr_t last = 0;
+        for (size_t i = 0; i < addrs.size() && i < indices.size(); ++i) {
+            const auto addr = addrs[i];
+            if (addr < last || size == 0 || addr < starts_[hint]) {
+                indices[i] = Find(addr);
+                if (indices[i] != npos) hint = indices[i];
+            } else {
+                size_t step = 1;
+                while (hint + step < size && starts_[hint + step] <= addr) {
+                    hint += step;
+                    step *= 2;
                 }
+                // the last start not above addr lies in [hint, hint + step)
+                auto limit = starts_.begin() + std::min(size, hint + step);
+                hint = static_cast<size_t>(
+                    std::upper_bound(starts_.begin() + hint, limit, addr) - starts_.begin() - 1);
+                indices[i] = addr < ends_[hint] ? hint : npos;
             }
+            last = addr;
         }
-        for (auto &map : maps) {
+    }
+
+    static std::optional<HookInfos> ScanHookInfo(const RegisterIndex &register_index) {
+        const PhaseTimer timer(stats.scan_ns);
+        Count(stats.scans);
+        static ino_t kSelfInode = 0;
+        static dev_t kSelfDev = 0;
+        HookInfos info;
+        auto self = reinterpret_cast<uintptr_t>(__builtin_return_address(0));
+        auto add = [&info](const lsplt::MapEntry &map) {
             // we basically only care about r-?p entry
             // and for offset == 0 it's an ELF header
             // and for offset != 0 it's what we hook
             // both of them should not be xom
             if (!map.is_private || !(map.perms & PROT_READ) || map.path.empty() ||
                 map.path[0] == '[') {
-                continue;
+                return;
+            }
+            const bool is_self = map.inode == kSelfInode && map.dev == kSelfDev;
+            info.infos_.emplace_back(HookInfo{{map.start, map.end, map.perms, map.is_private,
+                                               map.offset, map.dev, map.inode,
+                                               std::string{map.path}},
+                                              {},
+                                              {},
+                                              nullptr,
+                                              is_self});
+        };
+        std::optional<MapsQuery> query;
+        if (MapsQuery::Supported()) query.emplace("self");
+        if (query && query->Valid()) {
+            lsplt::MapEntry map;
+            if (kSelfInode == 0 && query->Query(self, 0, map)) {
+                kSelfInode = map.inode;
+                kSelfDev = map.dev;
+                LOGV("self inode = %lu", kSelfInode);
+            }
+            // walk file-backed mappings in binary form and only ask the kernel for the path of
+            // those that some registration refers to
+            for (uintptr_t addr = 0;
+                 query->Query(addr, MapsQuery::kCoveringOrNext | MapsQuery::kFileBacked |
+                                       MapsQuery::kReadable,
+                             map);
+                 addr = map.end) {
+                if (!map.is_private) continue;
+                if (!register_index.Contains(map.dev, map.inode)) continue;
+                if (!query->Query(map.start, 0, map, true)) continue;
+                add(map);
+            }
+        } else {
+            const bool found_self = kSelfInode != 0;
+            if (!lsplt::MapInfo::ForEach("self", [&](const lsplt::MapEntry &map) {
+                    if (kSelfInode == 0 && self >= map.start && self < map.end) {
+                        kSelfInode = map.inode;
+                        kSelfDev = map.dev;
+                        LOGV("self inode = %lu", kSelfInode);
+                    }
+                    add(map);
+                })) {
+                return std::nullopt;
+            }
+            // mappings of ourselves listed before the one holding our code were added before
+            // we learnt our inode
+            if (!found_self) {
+                for (auto &hook : info.infos_) {
+                    hook.self = hook.inode == kSelfInode && hook.dev == kSelfDev;
+                }
             }
-            auto start = map.start;
-            const bool self = map.inode == kSelfInode && map.dev == kSelfDev;
-            info.emplace(start, HookInfo{{std::move(map)}, {}, 0, nullptr, self});
         }
+        info.Index();
         return info;
     }
 
-    // filter out ignored
-    void Filter(const std::list<RegisterInfo> &register_info) {
-        for (auto iter = begin(); iter != end();) {
-            const auto &info = iter->second;
-            bool matched = false;
-            for (const auto &reg : register_info) {
-                if (info.Match(reg)) {
-                    matched = true;
-                    break;
-                }
+    // Scans only the mappings of the given libraries, and finds the file behind each of them on
+    // the way. Used for libraries loaded after the last full scan, whose regions are all new.
+    static std::optional<HookInfos> ScanLibraries(std::span<Library> libraries) {
+        const PhaseTimer timer(stats.scan_ns);
+        Count(stats.scans);
+        HookInfos info;
+        auto add = [&info](Library &library, const lsplt::MapEntry &map) {
+            if (map.start == library.module.base) library.SetFile(map);
+            if (!map.is_private || !(map.perms & PROT_READ) || map.path.empty() ||
+                map.path[0] == '[') {
+                return;
             }
-            if (matched) {
-                LOGV("Match hook info %s:%lu %" PRIxPTR " %" PRIxPTR "-%" PRIxPTR,
-                     iter->second.path.data(), iter->second.inode, iter->second.start,
-                     iter->second.end, iter->second.offset);
-                ++iter;
-            } else {
-                iter = erase(iter);
+            info.infos_.emplace_back(HookInfo{{map.start, map.end, map.perms, map.is_private,
+                                               map.offset, map.dev, map.inode,
+                                               std::string{map.path}},
+                                              {},
+                                              {},
+                                              nullptr,
+                                              false});
+        };
+        if (std::optional<MapsQuery> query;
+            MapsQuery::Supported() && query.emplace("self").Valid()) {
+            for (auto &library : libraries) {
+                if (library.self) continue;
+                lsplt::MapEntry map;
+                for (uintptr_t addr = library.module.base;
+                     query->Query(addr, MapsQuery::kCoveringOrNext | MapsQuery::kFileBacked, map) &&
+                     map.start < library.end;
+                     addr = map.end) {
+                    if (!map.is_private) continue;
+                    if (!query->Query(map.start, 0, map, true)) continue;
+                    add(library, map);
+                }
             }
+        } else if (!lsplt::MapInfo::ForEach("self", [&](const lsplt::MapEntry &map) {
+                       auto iter = std::upper_bound(libraries.begin(), libraries.end(), map.start,
+                                                    [](auto addr, const auto &library) {
+                                                        return addr < library.module.base;
+                                                    });
+                       if (iter == libraries.begin()) return;
+                       if (--iter; map.start < iter->end && !iter->self) add(*iter, map);
+                   })) {
+            return std::nullopt;
         }
+        info.Index();
+        return info;
+    }
+
+    // takes over the regions of libraries loaded since, dropping any left from an unloaded one
+    // at the same place along with the file pages it kept aside
+    void Adopt(HookInfos &&other) {
+        std::erase_if(infos_, [&other](const HookInfo &info) {
+            if (std::none_of(other.infos_.begin(), other.infos_.end(), [&info](const auto &add) {
+                    return info.start < add.end && add.start < info.end;
+                })) {
+                return false;
+            }
+            for (const auto &[page, backup] : info.backups) {
+                munmap(reinterpret_cast<void *>(backup), kPageSize);
+            }
+            return true;
+        });
+        std::move(other.infos_.begin(), other.infos_.end(), std::back_inserter(infos_));
+        Index();
+    }
+
+    // filter out ignored
+    void Filter(const RegisterIndex &register_index) {
+        const PhaseTimer timer(stats.filter_ns);
+        std::erase_if(infos_, [&register_index](const HookInfo &info) {
+            if (!register_index.Match(info.dev, info.inode, info.offset)) return true;
+            LOGV("Match hook info %s:%lu %" PRIxPTR " %" PRIxPTR "-%" PRIxPTR, info.path.data(),
+                 info.inode, info.start, info.end, info.offset);
+            return false;
+        });
+        Index();
     }
 
     void Merge(HookInfos &old) {
-        // merge with old map info
-        for (auto &info : old) {
-            if (info.second.backup) {
-                erase(info.second.backup);
-            }
-            if (auto iter = find(info.first); iter != end()) {
-                iter->second = std::move(info.second);
-            } else if (info.second.backup) {
-                emplace(info.first, std::move(info.second));
-            }
-        }
-    }
-
-    bool DoHook(uintptr_t addr, uintptr_t callback, uintptr_t *backup) {
-        LOGV("Hooking %p", reinterpret_cast<void *>(addr));
-        auto iter = lower_bound(addr);
-        if (iter == end()) return false;
-        // iter.first < addr
-        auto &info = iter->second;
-        if (info.end <= addr) return false;
-        const auto len = info.end - info.start;
-        if (!info.backup && !info.self) {
-            // let os find a suitable address
-            auto *backup_addr = sys_mmap(nullptr, len, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
-            LOGD("Backup %p to %p", reinterpret_cast<void *>(addr), backup_addr);
-            if (backup_addr == MAP_FAILED) return false;
-            if (auto *new_addr =
-                    sys_mremap(reinterpret_cast<void *>(info.start), len, len,
-                               MREMAP_FIXED | MREMAP_MAYMOVE | MREMAP_DONTUNMAP, backup_addr);
-                new_addr == MAP_FAILED || new_addr != backup_addr) {
-                new_addr = sys_mremap(reinterpret_cast<void *>(info.start), len, len,
-                           MREMAP_FIXED | MREMAP_MAYMOVE, backup_addr);
-                if (new_addr == MAP_FAILED || new_addr != backup_addr) {
-                    return false;
-                }
-                LOGD("Backup with MREMAP_DONTUNMAP failed, tried without it");
+        const PhaseTimer timer(stats.filter_ns);
+        // merge with old map info: the shadowed pages of a region we hooked split it into
+        // pieces in the new scan, and their backups show up as file mappings elsewhere, the old
+        // info takes over all of them
+        std::vector<uintptr_t> backups;
+        for (const auto &info : old.infos_) {
+            for (const auto &[page, backup] : info.backups) backups.push_back(backup);
+        }
+        std::sort(backups.begin(), backups.end());
+        std::vector<HookInfo> merged;
+        merged.reserve(infos_.size() + old.infos_.size());
+        uintptr_t covered = 0;
+        auto old_iter = old.infos_.begin();
+        for (auto &info : infos_) {
+            for (; old_iter != old.infos_.end() && old_iter->start < info.start; ++old_iter) {
+                if (old_iter->backups.empty()) continue;
+                covered = old_iter->end;
+                merged.emplace_back(std::move(*old_iter));
+            }
+            if (old_iter != old.infos_.end() && old_iter->start == info.start) {
+                covered = old_iter->end;
+                merged.emplace_back(std::move(*old_iter++));
+            } else if (info.start >= covered &&
+                       !std::binary_search(backups.begin(), backups.end(), info.start)) {
+                merged.emplace_back(std::move(info));
             }
-            if (auto *new_addr = sys_mmap(reinterpret_cast<void *>(info.start), len,
-                                          PROT_READ | PROT_WRITE | info.perms,
-                                          MAP_PRIVATE | MAP_FIXED | MAP_ANON, -1, 0);
-                new_addr == MAP_FAILED) {
+        }
+        for (; old_iter != old.infos_.end(); ++old_iter) {
+            if (!old_iter->backups.empty()) merged.emplace_back(std::move(*old_iter));
+        }
+        infos_ = std::move(merged);
+        // what was just scanned is loaded, the old regions are as loaded as they were
+        checked_unloads_ = old.checked_unloads_;
+        Index();
+    }
+
+    // Drops the regions of libraries unloaded since the last check, and unmaps their backups,
+    // so that unhooking never writes to memory the linker may have handed to another library.
+    // While the linker's unload counter stays the same, nothing is listed at all.
+    void DropUnloaded() {
+        auto generation = ScanCache::CurrentGeneration();
+        if (generation && checked_unloads_ == generation->second) return;
+        auto libraries = LoadedLibraries();
+        FindFiles(libraries);
+        std::erase_if(infos_, [&libraries](const HookInfo &info) {
+            if (info.self) return false;
+            auto iter = std::upper_bound(
+                libraries.begin(), libraries.end(), info.start,
+                [](auto addr, const auto &library) { return addr < library.module.base; });
+            if (iter != libraries.begin() && info.start < std::prev(iter)->end &&
+                std::prev(iter)->dev == info.dev && std::prev(iter)->inode == info.inode) {
                 return false;
             }
-            for (uintptr_t src = reinterpret_cast<uintptr_t>(backup_addr), dest = info.start,
-                           end = info.start + len;
-                 dest < end; src += kPageSize, dest += kPageSize) {
-                memcpy(reinterpret_cast<void *>(dest), reinterpret_cast<void *>(src), kPageSize);
+            LOGD("Dropping hook info %s %" PRIxPTR "-%" PRIxPTR " of an unloaded library",
+                 info.path.data(), info.start, info.end);
+            for (const auto &[page, backup] : info.backups) {
+                munmap(reinterpret_cast<void *>(backup), kPageSize);
+            }
+            return true;
+        });
+        Index();
+        if (generation) checked_unloads_ = generation->second;
+    }
+
+    // moves the file pages [first, last) of info aside and maps a private copy in their place
+    static bool Shadow(HookInfo &info, uintptr_t first, uintptr_t last) {
+        const auto len = last - first;
+        // let os find a suitable address
+        auto *backup_addr = sys_mmap(nullptr, len, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        LOGD("Backup %p to %p", reinterpret_cast<void *>(first), backup_addr);
+        if (backup_addr == MAP_FAILED) return false;
+        if (auto *new_addr =
+                sys_mremap(reinterpret_cast<void *>(first), len, len,
+                           MREMAP_FIXED | MREMAP_MAYMOVE | MREMAP_DONTUNMAP, backup_addr);
+            new_addr == MAP_FAILED || new_addr != backup_addr) {
+            new_addr = sys_mremap(reinterpret_cast<void *>(first), len, len,
+                                  MREMAP_FIXED | MREMAP_MAYMOVE, backup_addr);
+            if (new_addr == MAP_FAILED || new_addr != backup_addr) {
+                return false;
+            }
+            LOGD("Backup with MREMAP_DONTUNMAP failed, tried without it");
+        }
+        if (auto *new_addr = sys_mmap(reinterpret_cast<void *>(first), len,
+                                      PROT_READ | PROT_WRITE | info.perms,
+                                      MAP_PRIVATE | MAP_FIXED | MAP_ANON, -1, 0);
+            new_addr == MAP_FAILED) {
+            return false;
+        }
+        memcpy(reinterpret_cast<void *>(first), backup_addr, len);
+        Count(stats.pages_shadowed, len / kPageSize);
+        Count(stats.bytes_copied, len);
+        for (uintptr_t page = first, backup = reinterpret_cast<uintptr_t>(backup_addr);
+             page < last; page += kPageSize, backup += kPageSize) {
+            info.backups.emplace(page, backup);
+        }
+        return true;
+    }
+
+    // moves the file pages of the shadowed pages [first, last) back, which must be contiguous
+    // both in place and in their backup
+    static bool Restore(HookInfo &info, std::map<uintptr_t, uintptr_t>::iterator first,
+                        std::map<uintptr_t, uintptr_t>::iterator last) {
+        auto [page, backup] = *first;
+        const auto len = std::distance(first, last) * kPageSize;
+        LOGD("Restore %p from %p", reinterpret_cast<void *>(page),
+             reinterpret_cast<void *>(backup));
+        // Note that we have to always use sys_mremap here,
+        // see
+        // https://cs.android.com/android/_/android/platform/bionic/+/4200e260d266fd0c176e71fbd720d0bab04b02db
+        if (auto *new_addr = sys_mremap(reinterpret_cast<void *>(backup), len, len,
+                                        MREMAP_FIXED | MREMAP_MAYMOVE,
+                                        reinterpret_cast<void *>(page));
+            new_addr == MAP_FAILED || reinterpret_cast<uintptr_t>(new_addr) != page) {
+            return false;
+        }
+        info.backups.erase(first, last);
+        return true;
+    }
+
+    // Puts the file pages back wherever no hook is left. Pages shadowed together sit next to
+    // each other in their backup too, so each such run goes back with a single mremap, and
+    // page by page only if the run turns out to span backups of different shadowings.
+    static bool RestoreUnhooked(HookInfo &info) {
+        bool res = true;
+        for (auto iter = info.backups.begin(); iter != info.backups.end();) {
+            if (!Unhooked(info.hooks, iter->first)) {
+                ++iter;
+                continue;
+            }
+            auto last = std::next(iter);
+            for (auto prev = iter; last != info.backups.end() &&
+                                   last->first == prev->first + kPageSize &&
+                                   last->second == prev->second + kPageSize &&
+                                   Unhooked(info.hooks, last->first);
+                 prev = last++) {
+            }
+            auto next_run = last;
+            if (!Restore(info, iter, last)) {
+                for (auto page = iter; page != next_run;) {
+                    auto next = std::next(page);
+                    res = Restore(info, page, next) && res;
+                    page = next;
+                }
             }
-            info.backup = reinterpret_cast<uintptr_t>(backup_addr);
+            iter = next_run;
+        }
+        return res;
+    }
+
+    struct PendingSlot {
+        size_t region;
+        uintptr_t addr;
+        const RegisterInfo *reg;
+    };
+
+    // the pages holding slots that are not shadowed yet
+    static std::vector<uintptr_t> PagesToShadow(const HookInfo &info,
+                                                std::span<const PendingSlot> slots) {
+        std::vector<uintptr_t> pages;
+        pages.reserve(slots.size());
+        for (const auto &slot : slots) {
+            auto page = reinterpret_cast<uintptr_t>(PageStart(slot.addr));
+            if (!info.backups.contains(page)) pages.push_back(page);
+        }
+        std::sort(pages.begin(), pages.end());
+        pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+        return pages;
+    }
+
+    // records a slot written from original to callback, which is no longer hooked once set back
+    // to the value it had before it was first hooked
+    static void Track(std::map<uintptr_t, uintptr_t> &hooks, uintptr_t addr, uintptr_t original,
+                      uintptr_t callback) {
+        if (auto hook_iter = hooks.find(addr); hook_iter != hooks.end()) {
+            if (hook_iter->second == callback) hooks.erase(hook_iter);
+        } else {
+            hooks.emplace(addr, original);
         }
-        if (info.self) {
+    }
+
+    // whether a shadowed page holds no hook anymore, so its file page can be put back
+    static bool Unhooked(const std::map<uintptr_t, uintptr_t> &hooks, uintptr_t page) {
+        auto hook = hooks.lower_bound(page);
+        return hook == hooks.end() || hook->first >= reinterpret_cast<uintptr_t>(PageEnd(page));
+    }
+
+    // calls func with the slots of each region in turn
+    template <typename Func>
+    static void ForEachRegion(std::span<const PendingSlot> slots, Func &&func) {
+        for (auto first = slots.begin(); first != slots.end();) {
+            auto last = std::find_if(first, slots.end(), [&](const auto &slot) {
+                return slot.region != first->region;
+            });
+            func(first->region, std::span{first, last});
+            first = last;
+        }
+    }
+
+    // Writes all pending slots of one region. Only the pages holding them are shadowed, each
+    // contiguous run at once, so the rest of the mapping stays clean and file backed. GOT slots
+    // are only ever loaded as data by the PLT stubs, so no instruction cache maintenance is needed.
+    static bool DoHook(HookInfo &info, std::span<const PendingSlot> slots) {
+        if (!info.self) {
+            const auto pages = PagesToShadow(info, slots);
+            for (size_t first = 0, last = 1; first < pages.size(); first = last++) {
+                while (last < pages.size() && pages[last] == pages[last - 1] + kPageSize) ++last;
+                if (!Shadow(info, pages[first], pages[last - 1] + kPageSize)) return false;
+            }
+        } else {
             // self hooking, no need backup since we are always dirty
             if (!(info.perms & PROT_WRITE)) {
                 info.perms |= PROT_WRITE;
-                mprotect(reinterpret_cast<void *>(info.start), len, info.perms);
+                mprotect(reinterpret_cast<void *>(info.start), info.end - info.start, info.perms);
             }
         }
-        auto *the_addr = reinterpret_cast<uintptr_t *>(addr);
-        auto the_backup = *the_addr;
-        if (*the_addr != callback) {
-            *the_addr = callback;
-            if (backup) *backup = the_backup;
-            __builtin___clear_cache(PageStart(addr), PageEnd(addr));
+        for (const auto &slot : slots) {
+            LOGV("Hooking %p", reinterpret_cast<void *>(slot.addr));
+            auto *the_addr = reinterpret_cast<uintptr_t *>(slot.addr);
+            auto the_backup = *the_addr;
+            auto callback = reinterpret_cast<uintptr_t>(slot.reg->callback);
+            if (*the_addr != callback) {
+                *the_addr = callback;
+                if (slot.reg->backup) *slot.reg->backup = reinterpret_cast<void *>(the_backup);
+            }
+            Track(info.hooks, slot.addr, the_backup, callback);
         }
-        if (auto hook_iter = info.hooks.find(addr); hook_iter != info.hooks.end()) {
-            if (hook_iter->second == callback) info.hooks.erase(hook_iter);
-        } else {
-            info.hooks.emplace(addr, the_backup);
-        }
-        if (info.hooks.empty() && !info.self) {
-            LOGD("Restore %p from %p", reinterpret_cast<void *>(info.start),
-                 reinterpret_cast<void *>(info.backup));
-            // Note that we have to always use sys_mremap here,
-            // see
-            // https://cs.android.com/android/_/android/platform/bionic/+/4200e260d266fd0c176e71fbd720d0bab04b02db
-            if (auto *new_addr =
-                    sys_mremap(reinterpret_cast<void *>(info.backup), len, len,
-                               MREMAP_FIXED | MREMAP_MAYMOVE, reinterpret_cast<void *>(info.start));
-                new_addr == MAP_FAILED || reinterpret_cast<uintptr_t>(new_addr) != info.start) {
-                return false;
+        if (info.self) return true;
+        return RestoreUnhooked(info);
+    }
+
+    // Removes the hooks of info whose slot remove(addr) selects. The file pages left without a
+    // hook go back as they were with one remap per run, so only removed slots in pages still
+    // shadowed have their original value written. Hooks made permanent by InvalidateBackup are
+    // no longer tracked and stay.
+    template <typename Remove>
+    static bool Unhook(HookInfo &info, Remove &&remove) {
+        std::vector<std::pair<uintptr_t, uintptr_t>> removed;
+        for (auto iter = info.hooks.begin(); iter != info.hooks.end();) {
+            if (remove(iter->first)) {
+                removed.emplace_back(*iter);
+                iter = info.hooks.erase(iter);
+            } else {
+                ++iter;
             }
-            info.backup = 0;
         }
-        return true;
+        if (removed.empty()) return true;
+        bool res = info.self || RestoreUnhooked(info);
+        for (const auto &[addr, original] : removed) {
+            if (info.self || info.backups.contains(reinterpret_cast<uintptr_t>(PageStart(addr)))) {
+                *reinterpret_cast<uintptr_t *>(addr) = original;
+            }
+        }
+        return res;
     }
 
-    bool DoHook(std::list<RegisterInfo> &register_info) {
+    // Finds the slots that the registrations matching each region would write, grouped by
+    // region in registration order, and the registrations taken. This only reads memory, so
+    // commits and plans share it. The analysis of each library, from parsing its header to
+    // resolving its symbols, fills caches of its own, so libraries are analysed on a few workers.
+    bool Collect(RegisterIndex &register_index, const ScanCache &scan_cache, ElfCache &elf_cache,
+                 std::vector<PendingSlot> &slots, std::vector<RegisterIndex::Iterator> &taken) {
+        const PhaseTimer timer(stats.analysis_ns);
+        struct Target {
+            HookInfo *info;
+            std::vector<RegisterIndex::Iterator> regs;
+        };
+        std::vector<Target> targets;
+        for (auto &info : infos_) {
+            std::vector<RegisterIndex::Iterator> regs;
+            register_index.TakeStartingAt(info.dev, info.inode, info.offset,
+                                          [&regs](auto iter) { regs.emplace_back(iter); });
+            if (!regs.empty()) targets.emplace_back(&info, std::move(regs));
+        }
+        ParallelFor(targets.size(),
+                    targets.size() < kMinParallelLibraries ? 1 : DefaultWorkers(),
+                    [&](size_t i) {
+                        auto &[info, regs] = targets[i];
+                        if (!info->elf) info->elf = elf_cache.Get(*info, scan_cache);
+                        if (!info->elf->elf.Valid()) return;
+                        std::vector<SymbolKey> symbols;
+                        symbols.reserve(regs.size());
+                        for (const auto &iter : regs) symbols.emplace_back(iter->symbol);
+                        info->elf->Resolve(symbols);
+                    });
+
         bool res = true;
-        for (auto info_iter = rbegin(); info_iter != rend(); ++info_iter) {
-            auto &info = info_iter->second;
-            for (auto iter = register_info.begin(); iter != register_info.end();) {
-                const auto &reg = *iter;
-                if (info.offset != iter->offset_range.first || !info.Match(reg)) {
-                    ++iter;
-                    continue;
-                }
-                if (!info.elf) info.elf = std::make_unique<Elf>(info.start);
-                if (info.elf && info.elf->Valid()) {
-                    LOGD("Hooking %s", iter->symbol.data());
-                    for (auto addr : info.elf->FindPltAddr(reg.symbol)) {
-                        res = DoHook(addr, reinterpret_cast<uintptr_t>(reg.callback),
-                                     reinterpret_cast<uintptr_t *>(reg.backup)) &&
-                              res;
+        std::vector<size_t> indices;
+        for (auto &[info, regs] : targets) {
+            if (info->elf->elf.Valid()) {
+                for (const auto &iter : regs) {
+                    const auto &reg = *iter;
+                    LOGD("Hooking %s", reg.symbol.name.data());
+                    const auto &addrs = info->elf->FindPltAddr(reg.symbol);
+                    indices.resize(addrs.size());
+                    FindMany(addrs, indices);
+                    for (size_t i = 0; i < addrs.size(); ++i) {
+                        if (indices[i] == npos) {
+                            res = false;
+                            continue;
+                        }
+                        slots.emplace_back(indices[i], addrs[i], &reg);
                     }
                 }
-                iter = register_info.erase(iter);
             }
+            taken.insert(taken.end(), regs.begin(), regs.end());
+        }
+        // group by region while keeping the registration order of slots within one
+        std::stable_sort(slots.begin(), slots.end(),
+                         [](const auto &a, const auto &b) { return a.region < b.region; });
+        return res;
+    }
+
+    // Hooks in two stages: the slots are collected first, shadowing pages and writing slots
+    // then happens on the calling thread.
+    bool DoHook(std::list<RegisterInfo> &register_info, RegisterIndex &register_index,
+                const ScanCache &scan_cache, ElfCache &elf_cache) {
+        std::vector<PendingSlot> slots;
+        std::vector<RegisterIndex::Iterator> taken;
+        bool res = Collect(register_index, scan_cache, elf_cache, slots, taken);
+        const PhaseTimer timer(stats.patch_ns);
+        ForEachRegion(slots, [&](size_t region, std::span<const PendingSlot> region_slots) {
+            res = DoHook(infos_[region], region_slots) && res;
+        });
+        for (const auto &iter : taken) register_info.erase(iter);
+        return res;
+    }
+
+    // Removes the hooks of the given symbols, each only from its own library. Their slots are
+    // found through the regions the libraries were hooked through and grouped by the region
+    // they lie in, so every region is handled once.
+    bool Unhook(std::span<const lsplt::HookHandle> handles) {
+        auto key = [](const lsplt::HookHandle &handle) {
+            return std::pair{handle.dev, handle.inode};
+        };
+        std::vector<lsplt::HookHandle> sorted(handles.begin(), handles.end());
+        std::ranges::sort(sorted, {}, key);
+        std::vector<std::pair<size_t, uintptr_t>> slots;
+        for (auto &info : infos_) {
+            if (!info.elf || !info.elf->elf.Valid()) continue;
+            auto matches =
+                std::ranges::equal_range(sorted, std::pair{info.dev, info.inode}, {}, key);
+            for (const auto &handle : matches) {
+                for (auto addr : info.elf->FindPltAddr(SymbolKey{handle.symbol})) {
+                    if (auto region = Find(addr); region != npos) slots.emplace_back(region, addr);
+                }
+            }
+        }
+        std::sort(slots.begin(), slots.end());
+        bool res = true;
+        for (auto first = slots.begin(); first != slots.end();) {
+            auto last = std::find_if(first, slots.end(), [&](const auto &slot) {
+                return slot.first != first->first;
+            });
+            res = Unhook(infos_[first->first], [first, last](uintptr_t addr) {
+                return std::binary_search(first, last, std::pair{first->first, addr});
+            }) && res;
+            first = last;
         }
         return res;
     }
 
+    bool UnhookAll() {
+        bool res = true;
+        for (auto &info : infos_) {
+            res = Unhook(info, [](uintptr_t) { return true; }) && res;
+        }
+        return res;
+    }
+
+    // What DoHook would do, worked out from the same slots without writing anything.
+    lsplt::HookPlan Plan(RegisterIndex &register_index, const ScanCache &scan_cache,
+                         ElfCache &elf_cache) {
+        lsplt::HookPlan plan{};
+        std::vector<PendingSlot> slots;
+        std::vector<RegisterIndex::Iterator> taken;
+        plan.complete = Collect(register_index, scan_cache, elf_cache, slots, taken);
+        ForEachRegion(slots, [&](size_t region, std::span<const PendingSlot> region_slots) {
+            const auto &info = infos_[region];
+            auto &planned = plan.regions.emplace_back();
+            planned.map = info;
+            // the slot values and hooks as they would be after each write
+            std::map<uintptr_t, uintptr_t> values;
+            auto hooks = info.hooks;
+            for (const auto &slot : region_slots) {
+                auto callback = reinterpret_cast<uintptr_t>(slot.reg->callback);
+                planned.slots.emplace_back(slot.addr, std::string{slot.reg->symbol.name},
+                                           slot.reg->callback);
+                auto [value, _] =
+                    values.try_emplace(slot.addr, *reinterpret_cast<uintptr_t *>(slot.addr));
+                Track(hooks, slot.addr, std::exchange(value->second, callback), callback);
+            }
+            if (info.self) {
+                // written in place, every page holding a slot gets dirty
+                uintptr_t last_page = 0;
+                for (const auto &[addr, value] : values) {
+                    auto page = reinterpret_cast<uintptr_t>(PageStart(addr));
+                    if (std::exchange(last_page, page) != page) ++planned.dirty_pages;
+                }
+            } else {
+                planned.shadowed_pages = PagesToShadow(info, region_slots);
+                for (const auto &[page, backup] : info.backups) {
+                    if (Unhooked(hooks, page)) planned.restored_pages.emplace_back(page);
+                }
+                for (auto page : planned.shadowed_pages) {
+                    if (Unhooked(hooks, page)) planned.restored_pages.emplace_back(page);
+                }
+                std::sort(planned.restored_pages.begin(), planned.restored_pages.end());
+                planned.bytes_copied = planned.shadowed_pages.size() * kPageSize;
+                planned.dirty_pages = planned.shadowed_pages.size();
+            }
+            plan.slots += planned.slots.size();
+            plan.shadowed_pages += planned.shadowed_pages.size();
+            plan.restored_pages += planned.restored_pages.size();
+            plan.bytes_copied += planned.bytes_copied;
+            plan.dirty_pages += planned.dirty_pages;
+        });
+        return plan;
+    }
+
     bool InvalidateBackup() {
         bool res = true;
-        for (auto &[_, info] : *this) {
-            if (!info.backup) continue;
+        for (auto &info : infos_) {
+            if (info.backups.empty()) continue;
             for (auto &[addr, backup] : info.hooks) {
                 // store new address to backup since we don't need backup
                 backup = *reinterpret_cast<uintptr_t *>(addr);
             }
-            auto len = info.end - info.start;
-            if (auto *new_addr =
-                    mremap(reinterpret_cast<void *>(info.backup), len, len,
-                           MREMAP_FIXED | MREMAP_MAYMOVE, reinterpret_cast<void *>(info.start));
-                new_addr == MAP_FAILED || reinterpret_cast<uintptr_t>(new_addr) != info.start) {
-                res = false;
-                info.hooks.clear();
-                continue;
-            }
-            if (!mprotect(PageStart(info.start), len, PROT_WRITE)) {
-                for (auto &[addr, backup] : info.hooks) {
-                    *reinterpret_cast<uintptr_t *>(addr) = backup;
+            for (const auto &[page, backup] : info.backups) {
+                if (auto *new_addr =
+                        mremap(reinterpret_cast<void *>(backup), kPageSize, kPageSize,
+                               MREMAP_FIXED | MREMAP_MAYMOVE, reinterpret_cast<void *>(page));
+                    new_addr == MAP_FAILED || reinterpret_cast<uintptr_t>(new_addr) != page) {
+                    res = false;
+                    continue;
+                }
+                if (!mprotect(reinterpret_cast<void *>(page), kPageSize, PROT_WRITE)) {
+                    for (auto iter = info.hooks.lower_bound(page),
+                              end = info.hooks.lower_bound(page + kPageSize);
+                         iter != end; ++iter) {
+                        *reinterpret_cast<uintptr_t *>(iter->first) = iter->second;
+                    }
+                    mprotect(reinterpret_cast<void *>(page), kPageSize, info.perms);
                 }
-                mprotect(PageStart(info.start), len, info.perms);
             }
             info.hooks.clear();
-            info.backup = 0;
+            info.backups.clear();
         }
         return res;
     }
 };
 
+// Registrations made together, on their way from the registering threads to the next commit.
+struct PendingBatch {
+    std::list<RegisterInfo> registers;
+    std::list<WildcardInfo> wildcards;
+    PendingBatch *next = nullptr;
+};
+
+// Lock-free multi-producer single-consumer queue of batches: producers push onto a Treiber stack,
+// the consumer takes the whole stack at once and reverses it into push order. Entries are moved
+// out by splicing their list nodes, so names their symbols point to never move.
+class PendingQueue {
+    std::atomic<PendingBatch *> head_ = nullptr;
+
+public:
+    void Push(std::unique_ptr<PendingBatch> batch) {
+        auto *node = batch.release();
+        node->next = head_.load(std::memory_order_relaxed);
+        while (!head_.compare_exchange_weak(node->next, node, std::memory_order_release,
+                                            std::memory_order_relaxed)) {
+        }
+    }
+
+    template <typename Func>
+    void Drain(Func &&func) {
+        PendingBatch *reversed = nullptr;
+        for (auto *node = head_.exchange(nullptr, std::memory_order_acquire); node;) {
+            auto *next = node->next;
+            node->next = reversed;
+            reversed = node;
+            node = next;
+        }
+        while (reversed) {
+            std::unique_ptr<PendingBatch> batch{reversed};
+            reversed = reversed->next;
+            func(*batch);
+        }
+    }
+};
+
+// Flat combining of concurrent commits. Callers publish themselves, and the one that finds no
+// commit running becomes the combiner: its single commit answers every caller that arrived
+// before it started. Rounds are numbered, and a caller takes the next one to start as its
+// ticket, so it is only answered by a commit that began after it came, which takes in whatever
+// it registered before, and a running commit that may have missed it never answers it.
+class CommitCombiner {
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    uint64_t started_ = 0;
+    uint64_t completed_ = 0;
+    bool running_ = false;
+    // of the last completed round, which answers every caller waiting for it or an earlier one
+    bool result_ = false;
+
+public:
+    template <typename Commit>
+    bool Run(Commit &&commit) {
+        std::unique_lock lock(mutex_);
+        const auto ticket = started_ + 1;
+        while (completed_ < ticket) {
+            if (running_) {
+                cv_.wait(lock);
+                continue;
+            }
+            running_ = true;
+            ++started_;
+            lock.unlock();
+            auto result = commit();
+            lock.lock();
+            running_ = false;
+            ++completed_;
+            result_ = result;
+            cv_.notify_all();
+        }
+        return result_;
+    }
+
+    // Runs func between rounds without being one, for work that takes the pending registrations
+    // in without committing them, so that the queue is only ever drained under the combiner.
+    template <typename Func>
+    auto Exclusive(Func &&func) {
+        std::unique_lock lock(mutex_);
+        cv_.wait(lock, [this] { return !running_; });
+        running_ = true;
+        lock.unlock();
+        auto result = func();
+        lock.lock();
+        running_ = false;
+        cv_.notify_all();
+        return result;
+    }
+};
+
+PendingQueue pending_queue;
+CommitCombiner commit_combiner;
 std::mutex hook_mutex;
 std::list<RegisterInfo> register_info;
-HookInfos hook_info;
+std::list<WildcardInfo> pending_wildcards;
+// wildcard hooks already committed, kept as the registrations made from them refer to their names
+std::list<WildcardInfo> wildcard_info;
+// never destroyed, as the library destructor InvalidateBackup runs after static objects are gone
+HookInfos &hook_info = *new HookInfos;
+ScanCache scan_cache;
+ElfCache elf_cache;
+LoadWatcher load_watcher;
+std::atomic_bool auto_hook = false;
+// whether the dlopen hooks of auto hook are registered, which UnhookAll takes back
+bool auto_hook_installed = false;
+PlanCache plan_cache;
+ApkCache apk_cache;
+
+// writes the slots resolved since the last call to the plan cache, if one is used
+void SavePlans() {
+    if (plan_cache.Path().empty() || !elf_cache.Save(plan_cache)) return;
+    if (!plan_cache.Save()) LOGW("Failed to save hook plans to %s", plan_cache.Path().data());
+}
+
+// Takes the pending registrations in and brings the hook info up to date with the mappings, as
+// both a commit and a plan start with. Returns nullopt if the maps cannot be read. Only called
+// under commit_combiner, which tells each caller whether what it registered was committed.
+std::optional<RegisterIndex> Prepare() {
+    pending_queue.Drain([](PendingBatch &batch) {
+        register_info.splice(register_info.end(), batch.registers);
+        pending_wildcards.splice(pending_wildcards.end(), batch.wildcards);
+    });
+    if (!pending_wildcards.empty() || !wildcard_info.empty()) {
+        // the committed wildcards only still need the libraries loaded since they last looked,
+        // which auto hook may have done already
+        auto loaded = load_watcher.NewLibraries();
+        if (!wildcard_info.empty() && !loaded.empty()) {
+            FindFiles(loaded);
+            ExpandWildcards(wildcard_info, loaded, register_info, elf_cache);
+        }
+        if (!pending_wildcards.empty()) {
+            auto libraries = LoadedLibraries();
+            FindFiles(libraries);
+            ExpandWildcards(pending_wildcards, libraries, register_info, elf_cache);
+            wildcard_info.splice(wildcard_info.end(), pending_wildcards);
+        }
+    }
+
+    RegisterIndex register_index(register_info);
+    if (register_info.empty()) return register_index;
+    if (!scan_cache.Covers(register_info)) {
+        scan_cache.Reset(register_info);
+        auto new_hook_info = HookInfos::ScanHookInfo(register_index);
+        if (!new_hook_info) {
+            scan_cache.Clear();
+            return std::nullopt;
+        }
+
+        new_hook_info->Filter(register_index);
+
+        new_hook_info->Merge(hook_info);
+        // update to new map info
+        hook_info = std::move(*new_hook_info);
+        elf_cache.Prune(scan_cache);
+    } else {
+        LOGV("Nothing loaded or unloaded since last scan, reuse hook info");
+    }
+    return register_index;
+}
+
+bool Commit() {
+    auto register_index = Prepare();
+    if (!register_index) return false;
+    if (register_info.empty()) return true;
+
+    auto result = hook_info.DoHook(register_info, *register_index, scan_cache, elf_cache);
+    SavePlans();
+    return result;
+}
+
+// Applies the committed wildcard hooks, and the registrations still waiting for their library,
+// to the libraries loaded since the last call. Only the mappings of those are scanned.
+void HookNewLibraries() {
+    auto libraries = load_watcher.NewLibraries();
+    if (libraries.empty()) return;
+    auto new_hook_info = HookInfos::ScanLibraries(libraries);
+    if (!new_hook_info) return;
+    ExpandWildcards(wildcard_info, libraries, register_info, elf_cache);
+    if (register_info.empty()) return;
+
+    RegisterIndex register_index(register_info);
+    new_hook_info->Filter(register_index);
+    if (new_hook_info->empty()) return;
+    if (!new_hook_info->DoHook(register_info, register_index, scan_cache, elf_cache)) {
+        LOGE("Failed to hook newly loaded libraries");
+    }
+    hook_info.Adopt(std::move(*new_hook_info));
+    SavePlans();
+}
+
+// Loads that found hook_mutex taken. A dlopen from a library constructor runs with the linker's
+// lock held, which we take under hook_mutex to list libraries, so a load never waits for
+// hook_mutex: it leaves its libraries to whoever holds it, who hooks them once done.
+std::atomic_bool loads_pending = false;
+
+void HookPendingLoads() {
+    while (loads_pending.load() && auto_hook.load(std::memory_order_relaxed)) {
+        const std::unique_lock lock(hook_mutex, std::try_to_lock);
+        if (!lock.owns_lock()) return;
+        loads_pending.store(false);
+        if (auto_hook.load(std::memory_order_relaxed)) HookNewLibraries();
+    }
+}
+
+// hook_mutex, hooking on release the libraries of the loads that came meanwhile
+class HookLock {
+    std::unique_lock<std::mutex> lock_{hook_mutex};
+
+public:
+    HookLock() = default;
+    ~HookLock() {
+        lock_.unlock();
+        HookPendingLoads();
+    }
+    HookLock(const HookLock &) = delete;
+    HookLock &operator=(const HookLock &) = delete;
+};
+
+void OnLoaded() {
+    if (!auto_hook.load(std::memory_order_relaxed)) return;
+    loads_pending.store(true);
+    HookPendingLoads();
+}
+
+// The linker picks the namespace to load into from the caller, which would be us when going
+// through dlopen, so the loader entry points that take the caller are used where they exist.
+using DlopenFn = void *(*)(const char *, int);
+using AndroidDlopenExtFn = void *(*)(const char *, int, const void *);
+using LoaderDlopenFn = void *(*)(const char *, int, const void *);
+using LoaderAndroidDlopenExtFn = void *(*)(const char *, int, const void *, const void *);
+DlopenFn orig_dlopen = nullptr;
+AndroidDlopenExtFn orig_android_dlopen_ext = nullptr;
+LoaderDlopenFn loader_dlopen = nullptr;
+LoaderAndroidDlopenExtFn loader_android_dlopen_ext = nullptr;
+
+void *AutoDlopen(const char *filename, int flags) {
+    auto *caller = __builtin_return_address(0);
+    auto *handle =
+        loader_dlopen ? loader_dlopen(filename, flags, caller) : orig_dlopen(filename, flags);
+    if (handle) OnLoaded();
+    return handle;
+}
+
+void *AutoAndroidDlopenExt(const char *filename, int flags, const void *extinfo) {
+    auto *caller = __builtin_return_address(0);
+    auto *handle = loader_android_dlopen_ext
+                       ? loader_android_dlopen_ext(filename, flags, extinfo, caller)
+                       : orig_android_dlopen_ext(filename, flags, extinfo);
+    if (handle) OnLoaded();
+    return handle;
+}
 }  // namespace
 
 namespace lsplt::inline v2 {
 [[maybe_unused]] std::vector<MapInfo> MapInfo::Scan(std::string_view pid) {
-    constexpr static auto kPermLength = 5;
-    constexpr static auto kMapEntry = 7;
     std::vector<MapInfo> info;
-    auto path = "/proc/" + std::string{pid} + "/maps";
-    auto maps = std::unique_ptr<FILE, decltype(&fclose)>{fopen(path.c_str(), "r"), &fclose};
-    if (maps) {
-        char *line = nullptr;
-        size_t len = 0;
-        ssize_t read;
-        while ((read = getline(&line, &len, maps.get())) > 0) {
-            line[read - 1] = '\0';
-            uintptr_t start = 0;
-            uintptr_t end = 0;
-            uintptr_t off = 0;
-            ino_t inode = 0;
-            unsigned int dev_major = 0;
-            unsigned int dev_minor = 0;
-            std::array<char, kPermLength> perm{'\0'};
-            int path_off;
-            if (sscanf(line, "%" PRIxPTR "-%" PRIxPTR " %4s %" PRIxPTR " %x:%x %lu %n%*s", &start,
-                       &end, perm.data(), &off, &dev_major, &dev_minor, &inode,
-                       &path_off) != kMapEntry) {
-                continue;
-            }
-            while (path_off < read && isspace(line[path_off])) path_off++;
-            auto &ref = info.emplace_back(start, end, 0, perm[3] == 'p', off,
-                                          static_cast<dev_t>(makedev(dev_major, dev_minor)), inode,
-                                          line + path_off);
-            if (perm[0] == 'r') ref.perms |= PROT_READ;
-            if (perm[1] == 'w') ref.perms |= PROT_WRITE;
-            if (perm[2] == 'x') ref.perms |= PROT_EXEC;
-        }
-        free(line);
-    }
+    ForEach(pid, [&info](const MapEntry &entry) {
+        info.emplace_back(entry.start, entry.end, entry.perms, entry.is_private, entry.offset,
+                          entry.dev, entry.inode, std::string{entry.path});
+    });
     return info;
 }
 
+[[maybe_unused]] bool MapInfo::ForEach(std::string_view pid,
+                                       bool (*visitor)(const MapEntry &, void *), void *data) {
+    MapsReader reader(pid);
+    if (!reader.Valid()) return false;
+    for (MapEntry entry; reader.Next(entry);) {
+        if (!visitor(entry, data)) break;
+    }
+    return true;
+}
+
 [[maybe_unused]] bool RegisterHook(dev_t dev, ino_t inode, std::string_view symbol, void *callback,
                                    void **backup) {
     if (dev == 0 || inode == 0 || symbol.empty() || !callback) return false;
 
-    const std::unique_lock lock(hook_mutex);
+    auto batch = std::make_unique<PendingBatch>();
     static_assert(std::numeric_limits<uintptr_t>::min() == 0);
     static_assert(std::numeric_limits<uintptr_t>::max() == -1);
-    [[maybe_unused]] const auto &info = register_info.emplace_back(
-        dev, inode,
+    [[maybe_unused]] const auto &info = AddRegisterInfo(
+        batch->registers, dev, inode,
         std::pair{std::numeric_limits<uintptr_t>::min(), std::numeric_limits<uintptr_t>::max()},
-        std::string{symbol}, callback, backup);
+        std::string{symbol}, symbol, callback, backup);
 
-    LOGV("RegisterHook %lu %s", info.inode, info.symbol.data());
+    LOGV("RegisterHook %lu %s", info.inode, info.symbol.name.data());
+    pending_queue.Push(std::move(batch));
     return true;
 }
 
@@ -307,35 +1613,287 @@ namespace lsplt::inline v2 {
                                    std::string_view symbol, void *callback, void **backup) {
     if (dev == 0 || inode == 0 || symbol.empty() || !callback) return false;
 
-    const std::unique_lock lock(hook_mutex);
-    static_assert(std::numeric_limits<uintptr_t>::min() == 0);
-    static_assert(std::numeric_limits<uintptr_t>::max() == -1);
-    [[maybe_unused]] const auto &info = register_info.emplace_back(
-        dev, inode, std::pair{offset, offset + size}, std::string{symbol}, callback, backup);
+    auto batch = std::make_unique<PendingBatch>();
+    [[maybe_unused]] const auto &info =
+        AddRegisterInfo(batch->registers, dev, inode, std::pair{offset, offset + size},
+                        std::string{symbol}, symbol, callback, backup);
 
     LOGV("RegisterHook %lu %" PRIxPTR "-%" PRIxPTR " %s", info.inode, info.offset_range.first,
-         info.offset_range.second, info.symbol.data());
+         info.offset_range.second, info.symbol.name.data());
+    pending_queue.Push(std::move(batch));
+    return true;
+}
+
+[[maybe_unused]] bool RegisterHook(dev_t dev, ino_t inode, Symbol symbol, void *callback,
+                                   void **backup) {
+    return RegisterHook(dev, inode, std::numeric_limits<uintptr_t>::min(),
+                        std::numeric_limits<uintptr_t>::max(), symbol, callback, backup);
+}
+
+[[maybe_unused]] bool RegisterHook(dev_t dev, ino_t inode, uintptr_t offset, size_t size,
+                                   Symbol symbol, void *callback, void **backup) {
+    if (dev == 0 || inode == 0 || symbol.size() == 0 || !callback) return false;
+
+    auto batch = std::make_unique<PendingBatch>();
+    [[maybe_unused]] const auto &info =
+        AddRegisterInfo(batch->registers, dev, inode, std::pair{offset, offset + size}, {}, symbol,
+                        callback, backup);
+
+    LOGV("RegisterHook %lu %" PRIxPTR "-%" PRIxPTR " %s", info.inode, info.offset_range.first,
+         info.offset_range.second, info.symbol.name.data());
+    pending_queue.Push(std::move(batch));
+    return true;
+}
+
+[[maybe_unused]] bool RegisterHooks(dev_t dev, ino_t inode, std::span<const HookSpec> hooks) {
+    return RegisterHooks(dev, inode, std::numeric_limits<uintptr_t>::min(),
+                         std::numeric_limits<uintptr_t>::max(), hooks);
+}
+
+[[maybe_unused]] bool RegisterHooks(dev_t dev, ino_t inode, uintptr_t offset, size_t size,
+                                    std::span<const HookSpec> hooks) {
+    if (dev == 0 || inode == 0) return false;
+    if (std::any_of(hooks.begin(), hooks.end(),
+                    [](const auto &hook) { return hook.symbol.empty() || !hook.callback; })) {
+        return false;
+    }
+
+    auto batch = std::make_unique<PendingBatch>();
+    for (const auto &hook : hooks) {
+        AddRegisterInfo(batch->registers, dev, inode, std::pair{offset, offset + size},
+                        std::string{hook.symbol}, hook.symbol, hook.callback, hook.backup);
+    }
+
+    LOGV("RegisterHooks %lu %" PRIxPTR "-%" PRIxPTR " %zu hooks", inode, offset, offset + size,
+         hooks.size());
+    pending_queue.Push(std::move(batch));
+    return true;
+}
+
+[[maybe_unused]] bool RegisterHookAll(std::string_view path_glob, std::string_view symbol,
+                                      void *callback, void **backup) {
+    const HookSpec hook{symbol, callback, backup};
+    return RegisterHookAll(path_glob, {&hook, 1});
+}
+
+[[maybe_unused]] bool RegisterHookAll(std::string_view path_glob, Symbol symbol, void *callback,
+                                      void **backup) {
+    if (symbol.size() == 0 || !callback) return false;
+
+    auto batch = std::make_unique<PendingBatch>();
+    auto &info = batch->wildcards.emplace_back(std::string{path_glob}, std::string{}, symbol,
+                                               callback, backup);
+
+    LOGV("RegisterHookAll %s %s", info.path_glob.data(), info.symbol.name.data());
+    pending_queue.Push(std::move(batch));
+    return true;
+}
+
+[[maybe_unused]] bool RegisterHookAll(std::string_view path_glob,
+                                      std::span<const HookSpec> hooks) {
+    if (std::any_of(hooks.begin(), hooks.end(),
+                    [](const auto &hook) { return hook.symbol.empty() || !hook.callback; })) {
+        return false;
+    }
+
+    auto batch = std::make_unique<PendingBatch>();
+    for (const auto &hook : hooks) {
+        auto &info = batch->wildcards.emplace_back(std::string{path_glob},
+                                                   std::string{hook.symbol}, hook.symbol,
+                                                   hook.callback, hook.backup);
+        info.symbol.name = info.name;
+    }
+
+    LOGV("RegisterHookAll %.*s %zu hooks", static_cast<int>(path_glob.size()), path_glob.data(),
+         hooks.size());
+    pending_queue.Push(std::move(batch));
     return true;
 }
 
 [[maybe_unused]] bool CommitHook() {
-    const std::unique_lock lock(hook_mutex);
-    if (register_info.empty()) return true;
+    return commit_combiner.Run([] {
+        const HookLock lock;
+        return Commit();
+    });
+}
+
+[[maybe_unused]] HookPlan PlanHooks() {
+    return commit_combiner.Exclusive([]() -> HookPlan {
+        const HookLock lock;
+        auto register_index = Prepare();
+        if (!register_index) return {};
+        return hook_info.Plan(*register_index, scan_cache, elf_cache);
+    });
+}
+
+[[maybe_unused]] Stats GetStats() {
+    auto load = [](const auto &counter) { return counter.load(std::memory_order_relaxed); };
+    return {
+        .scans = load(stats.scans),
+        .maps_parsed = load(stats.maps_parsed),
+        .elfs_parsed = load(stats.elfs_parsed),
+        .gnu_lookups = load(stats.gnu_lookups),
+        .sysv_lookups = load(stats.sysv_lookups),
+        .linear_lookups = load(stats.linear_lookups),
+        .relocations_walked = load(stats.relocations_walked),
+        .pages_shadowed = load(stats.pages_shadowed),
+        .bytes_copied = load(stats.bytes_copied),
+        .scan_ns = load(stats.scan_ns),
+        .filter_ns = load(stats.filter_ns),
+        .analysis_ns = load(stats.analysis_ns),
+        .patch_ns = load(stats.patch_ns),
+    };
+}
 
-    auto new_hook_info = HookInfos::ScanHookInfo();
-    if (new_hook_info.empty()) return false;
+[[maybe_unused]] void ResetStats() {
+    for (auto *counter : {&stats.scans, &stats.maps_parsed, &stats.elfs_parsed, &stats.gnu_lookups,
+                          &stats.sysv_lookups, &stats.linear_lookups, &stats.relocations_walked,
+                          &stats.pages_shadowed, &stats.bytes_copied, &stats.scan_ns,
+                          &stats.filter_ns, &stats.analysis_ns, &stats.patch_ns}) {
+        counter->store(0, std::memory_order_relaxed);
+    }
+}
 
-    new_hook_info.Filter(register_info);
+[[maybe_unused]] bool SetAutoHook(bool enable) {
+    {
+        const HookLock lock;
+        if (!enable) {
+            auto_hook.store(false, std::memory_order_relaxed);
+            return true;
+        }
+        if (auto_hook.load(std::memory_order_relaxed)) return true;
+        if (!orig_dlopen) {
+            // resolved up front, so a call racing with the commit below never sees a null
+            // original
+            orig_dlopen = reinterpret_cast<DlopenFn>(dlsym(RTLD_DEFAULT, "dlopen"));
+            if (!orig_dlopen) return false;
+            orig_android_dlopen_ext =
+                reinterpret_cast<AndroidDlopenExtFn>(dlsym(RTLD_DEFAULT, "android_dlopen_ext"));
+            loader_dlopen =
+                reinterpret_cast<LoaderDlopenFn>(dlsym(RTLD_DEFAULT, "__loader_dlopen"));
+            loader_android_dlopen_ext = reinterpret_cast<LoaderAndroidDlopenExtFn>(
+                dlsym(RTLD_DEFAULT, "__loader_android_dlopen_ext"));
+        }
+        if (!auto_hook_installed) {
+            auto_hook_installed = true;
+            pending_wildcards.emplace_back(std::string{}, std::string{}, Symbol{"dlopen"},
+                                           reinterpret_cast<void *>(AutoDlopen), nullptr);
+            if (orig_android_dlopen_ext) {
+                pending_wildcards.emplace_back(std::string{}, std::string{},
+                                               Symbol{"android_dlopen_ext"},
+                                               reinterpret_cast<void *>(AutoAndroidDlopenExt),
+                                               nullptr);
+            }
+        } else {
+            // catch up with what was loaded while disabled
+            HookNewLibraries();
+        }
+        auto_hook.store(true, std::memory_order_relaxed);
+        LOGV("Auto hook enabled");
+    }
+    // the dlopen hooks go in through the combiner like any other commit
+    return CommitHook();
+}
+
+[[maybe_unused]] bool Unhook(std::span<const HookHandle> handles) {
+    const HookLock lock;
+    // as well as the registrations still waiting for their library
+    std::erase_if(register_info, [handles](const RegisterInfo &reg) {
+        return std::any_of(handles.begin(), handles.end(), [&reg](const auto &handle) {
+            return handle.dev == reg.dev && handle.inode == reg.inode &&
+                   handle.symbol == reg.symbol.name;
+        });
+    });
+    hook_info.DropUnloaded();
+    return hook_info.Unhook(handles);
+}
 
-    new_hook_info.Merge(hook_info);
-    // update to new map info
-    hook_info = std::move(new_hook_info);
+[[maybe_unused]] bool UnhookAll() {
+    const HookLock lock;
+    auto_hook.store(false, std::memory_order_relaxed);
+    auto_hook_installed = false;
+    // registrations made from wildcard hooks point into their names, so both go at once
+    register_info.clear();
+    wildcard_info.clear();
+    hook_info.DropUnloaded();
+    return hook_info.UnhookAll();
+}
 
-    return hook_info.DoHook(register_info);
+[[maybe_unused]] bool SetPlanCache(std::string_view path) {
+    const HookLock lock;
+    if (path.empty()) {
+        plan_cache.Close();
+        elf_cache.SetPlanCache(nullptr);
+        return true;
+    }
+    auto opened = plan_cache.Open(path);
+    elf_cache.SetPlanCache(&plan_cache);
+    return opened;
+}
+
+[[maybe_unused]] bool PrecomputePlan(std::string_view cache_path, std::string_view library_path,
+                                     std::span<const std::string_view> symbols) {
+    const std::string path{library_path};
+    const ElfFile file(path.c_str());
+    if (!file.Valid()) return false;
+    const auto &elf = file.Get();
+    const auto build_id = elf.BuildId();
+    if (build_id.empty()) return false;
+    const auto library = FindFileOf(elf.Base());
+    if (!library) return false;
+    const auto relocations = elf.RelocationsLayout();
+
+    const std::vector<SymbolKey> keys(symbols.begin(), symbols.end());
+    const auto found = elf.FindPltAddr(keys);
+
+    const HookLock lock;
+    PlanCache other;
+    auto *cache = &plan_cache;
+    if (plan_cache.Path() != cache_path) {
+        other.Open(cache_path);
+        cache = &other;
+    }
+    std::vector<uint64_t> offsets;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        offsets.clear();
+        for (auto addr : found[i]) offsets.emplace_back(addr - elf.Bias());
+        cache->Record(library->first, library->second, build_id, relocations, keys[i].name,
+                      offsets);
+    }
+    return cache->Save();
+}
+
+[[maybe_unused]] std::optional<ApkLibrary> FindApkLibrary(std::string_view apk_path,
+                                                         std::string_view abi,
+                                                         std::string_view name) {
+    std::pair<dev_t, ino_t> mapped;
+    auto libraries = apk_cache.Get(apk_path, mapped);
+    if (!libraries) return std::nullopt;
+    auto path = std::string{"lib/"}.append(abi).append("/").append(name);
+    const auto *entry = libraries->Find(path);
+    if (!entry) return std::nullopt;
+    return ApkLibrary{mapped.first, mapped.second, static_cast<uintptr_t>(entry->offset),
+                      static_cast<size_t>(entry->size), std::move(path)};
+}
+
+[[maybe_unused]] std::vector<ApkLibrary> ListApkLibraries(std::string_view apk_path,
+                                                          std::string_view abi) {
+    std::vector<ApkLibrary> res;
+    std::pair<dev_t, ino_t> mapped;
+    auto libraries = apk_cache.Get(apk_path, mapped);
+    if (!libraries) return res;
+    for (const auto &entry : libraries->Entries()) {
+        auto path = libraries->Name(entry);
+        // lib/<abi>/<name>.so
+        if (!abi.empty() && path.substr(4, path.find('/', 4) - 4) != abi) continue;
+        res.push_back({mapped.first, mapped.second, static_cast<uintptr_t>(entry.offset),
+                       static_cast<size_t>(entry.size), std::string{path}});
+    }
+    return res;
 }
 
 [[gnu::destructor]] [[maybe_unused]] bool InvalidateBackup() {
-    const std::unique_lock lock(hook_mutex);
+    const HookLock lock;
     return hook_info.InvalidateBackup();
 }
 }  // namespace lsplt::inline v2
@@ -0,0 +1,346 @@
+#include "maps_util.hpp"
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+
+#include "parallel.hpp"
+#include "stats.hpp"
+
+#ifndef PROCMAP_QUERY
+struct procmap_query {
+    uint64_t size;
+    uint64_t query_flags;
+    uint64_t query_addr;
+    uint64_t vma_start;
+    uint64_t vma_end;
+    uint64_t vma_flags;
+    uint64_t vma_page_size;
+    uint64_t vma_offset;
+    uint64_t inode;
+    uint32_t dev_major;
+    uint32_t dev_minor;
+    uint32_t vma_name_size;
+    uint32_t build_id_size;
+    uint64_t vma_name_addr;
+    uint64_t build_id_addr;
+};
+#define PROCMAP_QUERY _IOWR('f', 17, struct procmap_query)
+#endif
+
+namespace {
+inline int HexDigit(char chr) {
+    if (chr >= '0' && chr <= '9') return chr - '0';
+    if (chr >= 'a' && chr <= 'f') return chr - 'a' + 10;
+    if (chr >= 'A' && chr <= 'F') return chr - 'A' + 10;
+    return -1;
+}
+
+template <typename T>
+inline bool ParseHex(const char *&cur, const char *end, T &out) {
+    T val = 0;
+    const auto *begin = cur;
+    for (int digit; cur < end && (digit = HexDigit(*cur)) >= 0; ++cur) {
+        val = (val << 4) | static_cast<T>(digit);
+    }
+    out = val;
+    return cur != begin;
+}
+
+template <typename T>
+inline bool ParseDec(const char *&cur, const char *end, T &out) {
+    T val = 0;
+    const auto *begin = cur;
+    for (; cur < end && *cur >= '0' && *cur <= '9'; ++cur) {
+        val = val * 10 + static_cast<T>(*cur - '0');
+    }
+    out = val;
+    return cur != begin;
+}
+
+inline bool Expect(const char *&cur, const char *end, char chr) {
+    if (cur >= end || *cur != chr) return false;
+    ++cur;
+    return true;
+}
+
+inline void SkipSpaces(const char *&cur, const char *end) {
+    while (cur < end && (*cur == ' ' || *cur == '\t')) ++cur;
+}
+}  // namespace
+
+MapsReader::MapsReader(std::string_view pid) {
+    char path[64];
+    if (auto len = snprintf(path, sizeof(path), "/proc/%.*s/maps", static_cast<int>(pid.size()),
+                            pid.data());
+        len < 0 || static_cast<size_t>(len) >= sizeof(path)) {
+        return;
+    }
+    fd_ = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd_ >= 0) buffer_ = std::make_unique<char[]>(kBufferSize);
+}
+
+MapsReader::~MapsReader() {
+    if (fd_ >= 0) close(fd_);
+    Count(stats.maps_parsed, parsed_);
+}
+
+bool MapsReader::Fill() {
+    if (eof_) return false;
+    if (begin_ != 0) {
+        memmove(buffer_.get(), buffer_.get() + begin_, end_ - begin_);
+        end_ -= begin_;
+        begin_ = 0;
+    }
+    // a single line never exceeds PATH_MAX plus the fixed columns
+    if (end_ == kBufferSize) return false;
+    ssize_t len;
+    do {
+        len = read(fd_, buffer_.get() + end_, kBufferSize - end_);
+    } while (len < 0 && errno == EINTR);
+    if (len <= 0) {
+        eof_ = true;
+        error_ = len < 0;
+        return false;
+    }
+    end_ += len;
+    return true;
+}
+
+bool MapsReader::Next(lsplt::MapEntry &entry) {
+    if (fd_ < 0) return false;
+    while (true) {
+        auto *begin = buffer_.get() + begin_;
+        if (auto *newline = static_cast<char *>(memchr(begin, '\n', end_ - begin_))) {
+            begin_ += newline - begin + 1;
+            if (ParseLine({begin, static_cast<size_t>(newline - begin)}, entry)) {
+                ++parsed_;
+                return true;
+            }
+        } else if (!Fill()) {
+            // the last line may not end with a newline
+            begin = buffer_.get() + begin_;
+            auto size = end_ - begin_;
+            begin_ = end_;
+            if (size == 0 || !ParseLine({begin, size}, entry)) return false;
+            ++parsed_;
+            return true;
+        }
+    }
+}
+
+bool MapsReader::ParseLine(std::string_view line, lsplt::MapEntry &entry) {
+    const auto *cur = line.data();
+    const auto *end = cur + line.size();
+    unsigned int dev_major = 0;
+    unsigned int dev_minor = 0;
+    if (!ParseHex(cur, end, entry.start) || !Expect(cur, end, '-') ||
+        !ParseHex(cur, end, entry.end) || !Expect(cur, end, ' ')) {
+        return false;
+    }
+    if (end - cur < 5 || cur[4] != ' ') return false;
+    entry.perms = 0;
+    if (cur[0] == 'r') entry.perms |= PROT_READ;
+    if (cur[1] == 'w') entry.perms |= PROT_WRITE;
+    if (cur[2] == 'x') entry.perms |= PROT_EXEC;
+    entry.is_private = cur[3] == 'p';
+    cur += 5;
+    if (!ParseHex(cur, end, entry.offset) || !Expect(cur, end, ' ') ||
+        !ParseHex(cur, end, dev_major) || !Expect(cur, end, ':') ||
+        !ParseHex(cur, end, dev_minor) || !Expect(cur, end, ' ') ||
+        !ParseDec(cur, end, entry.inode)) {
+        return false;
+    }
+    entry.dev = static_cast<dev_t>(makedev(dev_major, dev_minor));
+    SkipSpaces(cur, end);
+    entry.path = {cur, static_cast<size_t>(end - cur)};
+    return true;
+}
+
+MapsQuery::MapsQuery(std::string_view pid) {
+    char path[64];
+    if (auto len = snprintf(path, sizeof(path), "/proc/%.*s/maps", static_cast<int>(pid.size()),
+                            pid.data());
+        len < 0 || static_cast<size_t>(len) >= sizeof(path)) {
+        return;
+    }
+    fd_ = open(path, O_RDONLY | O_CLOEXEC);
+}
+
+MapsQuery::~MapsQuery() {
+    if (fd_ >= 0) close(fd_);
+}
+
+bool MapsQuery::Supported() {
+    static const bool kSupported = [] {
+        MapsQuery query("self");
+        lsplt::MapEntry entry;
+        // any address of our own text must be covered
+        return query.Valid() &&
+               query.Query(reinterpret_cast<uintptr_t>(&MapsQuery::Supported), 0, entry);
+    }();
+    return kSupported;
+}
+
+bool MapsQuery::Query(uintptr_t addr, uint64_t flags, lsplt::MapEntry &entry, bool with_name) {
+    procmap_query query{};
+    query.size = sizeof(query);
+    query.query_flags = flags;
+    query.query_addr = addr;
+    if (with_name) {
+        query.vma_name_addr = reinterpret_cast<uintptr_t>(name_.data());
+        query.vma_name_size = name_.size();
+    }
+    int ret;
+    do {
+        ret = ioctl(fd_, PROCMAP_QUERY, &query);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) return false;
+    Count(stats.maps_parsed);
+    entry.start = query.vma_start;
+    entry.end = query.vma_end;
+    entry.perms = 0;
+    if (query.vma_flags & kReadable) entry.perms |= PROT_READ;
+    if (query.vma_flags & kWritable) entry.perms |= PROT_WRITE;
+    if (query.vma_flags & kExecutable) entry.perms |= PROT_EXEC;
+    entry.is_private = !(query.vma_flags & kShared);
+    entry.offset = query.vma_offset;
+    entry.dev = static_cast<dev_t>(makedev(query.dev_major, query.dev_minor));
+    entry.inode = query.inode;
+    // vma_name_size includes the terminating null
+    entry.path = with_name && query.vma_name_size
+                     ? std::string_view{name_.data(), query.vma_name_size - 1}
+                     : std::string_view{};
+    return true;
+}
+
+namespace lsplt::inline v2 {
+[[maybe_unused]] MapTable MapTable::Scan(std::string_view pid) {
+    MapTable table;
+    if (!Scan(pid, table)) table = {};
+    return table;
+}
+
+bool MapTable::Scan(std::string_view pid, MapTable &table) {
+    MapsReader reader(pid);
+    if (!reader.Valid()) return false;
+    // open addressing over path ids, keyed by the path content in the pool
+    std::vector<uint32_t> slots(64, std::numeric_limits<uint32_t>::max());
+    auto path_of = [&table](uint32_t id) {
+        return std::string_view{table.paths_}.substr(
+            table.path_offsets_[id], table.path_offsets_[id + 1] - table.path_offsets_[id]);
+    };
+    auto intern = [&](std::string_view path) -> uint32_t {
+        // segments of the same library are adjacent
+        if (!table.path_ids_.empty() && path_of(table.path_ids_.back()) == path) {
+            return table.path_ids_.back();
+        }
+        auto mask = slots.size() - 1;
+        auto idx = std::hash<std::string_view>{}(path) & mask;
+        for (; slots[idx] != std::numeric_limits<uint32_t>::max(); idx = (idx + 1) & mask) {
+            if (path_of(slots[idx]) == path) return slots[idx];
+        }
+        uint32_t id = table.path_offsets_.size() - 1;
+        table.paths_.append(path);
+        table.path_offsets_.push_back(table.paths_.size());
+        slots[idx] = id;
+        if ((id + 1) * 2 > slots.size()) {
+            std::vector<uint32_t> grown(slots.size() * 2, std::numeric_limits<uint32_t>::max());
+            mask = grown.size() - 1;
+            for (auto old : slots) {
+                if (old == std::numeric_limits<uint32_t>::max()) continue;
+                auto pos = std::hash<std::string_view>{}(path_of(old)) & mask;
+                while (grown[pos] != std::numeric_limits<uint32_t>::max()) pos = (pos + 1) & mask;
+                grown[pos] = old;
+            }
+            slots = std::move(grown);
+        }
+        return id;
+    };
+    table.path_offsets_.push_back(0);
+    for (MapEntry entry; reader.Next(entry);) {
+        table.starts_.push_back(entry.start);
+        table.ends_.push_back(entry.end);
+        table.offsets_.push_back(entry.offset);
+        table.devs_.push_back(entry.dev);
+        table.inodes_.push_back(entry.inode);
+        table.perms_.push_back(entry.perms | (entry.is_private ? kPrivate : 0));
+        table.path_ids_.push_back(intern(entry.path));
+    }
+    table.starts_.shrink_to_fit();
+    table.ends_.shrink_to_fit();
+    table.offsets_.shrink_to_fit();
+    table.devs_.shrink_to_fit();
+    table.inodes_.shrink_to_fit();
+    table.perms_.shrink_to_fit();
+    table.path_ids_.shrink_to_fit();
+    table.path_offsets_.shrink_to_fit();
+    table.paths_.shrink_to_fit();
+    return !reader.Error();
+}
+
+[[maybe_unused]] void MapTable::ScanMany(std::span<const pid_t> pids,
+                                         void (*callback)(pid_t, const MapTable &, void *),
+                                         void *data, size_t workers) {
+    std::mutex callback_mutex;
+    ParallelFor(pids.size(), workers ? workers : DefaultWorkers(), [&](size_t i) {
+        std::array<char, std::numeric_limits<pid_t>::digits10 + 2> buf;
+        auto [ptr, ec] = std::to_chars(buf.data(), buf.data() + buf.size(), pids[i]);
+        if (ec != std::errc{}) return;
+        MapTable table;
+        // the process may be gone, or be a zombie whose maps read empty
+        if (!Scan({buf.data(), static_cast<size_t>(ptr - buf.data())}, table) || table.empty()) {
+            return;
+        }
+        const std::lock_guard lock(callback_mutex);
+        callback(pids[i], table, data);
+    });
+}
+
+[[maybe_unused]] size_t MapTable::Find(uintptr_t addr) const {
+    auto iter = std::upper_bound(starts_.begin(), starts_.end(), addr);
+    if (iter == starts_.begin()) return npos;
+    auto idx = static_cast<size_t>(iter - starts_.begin() - 1);
+    return addr < ends_[idx] ? idx : npos;
+}
+
+[[maybe_unused]] void MapTable::FindMany(std::span<const uintptr_t> addrs,
+                                         std::span<size_t> indices) const {
+    size_t hint = 0;
+    uintptr_t last = 0;
+    for (size_t i = 0; i < addrs.size() && i < indices.size(); ++i) {
+        auto addr = addrs[i];
+        auto first = starts_.begin();
+        auto limit = starts_.end();
+        if (addr >= last) {
+            // gallop forward from the previous position, which starts at or below addr
+            size_t step = 1;
+            while (hint + step < size() && starts_[hint + step] <= addr) {
+                hint += step;
+                step *= 2;
+            }
+            first += hint;
+            limit = starts_.begin() + std::min(size(), hint + step + 1);
+        }
+        auto iter = std::upper_bound(first, limit, addr);
+        if (iter == starts_.begin()) {
+            indices[i] = npos;
+            hint = 0;
+        } else {
+            hint = static_cast<size_t>(iter - starts_.begin() - 1);
+            indices[i] = addr < ends_[hint] ? hint : npos;
+        }
+        last = addr;
+    }
+}
+}  // namespace lsplt::inline v2
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <linux/limits.h>
+
+#include <array>
+#include <memory>
+#include <string_view>
+
+#include "include/lsplt.hpp"
+
+// Streaming tokenizer for /proc/<pid>/maps. It reads the file in large chunks and yields
+// entries whose path points into the internal buffer, so no allocation happens per line.
+class MapsReader {
+    static constexpr size_t kBufferSize = 64 * 1024;
+
+    int fd_ = -1;
+    std::unique_ptr<char[]> buffer_;
+    size_t begin_ = 0;
+    size_t end_ = 0;
+    bool eof_ = false;
+    bool error_ = false;
+    // entries read, added to the stats once done
+    size_t parsed_ = 0;
+
+    bool Fill();
+
+public:
+    MapsReader(std::string_view pid);
+    ~MapsReader();
+    MapsReader(const MapsReader &) = delete;
+    MapsReader &operator=(const MapsReader &) = delete;
+
+    bool Valid() const { return fd_ >= 0; }
+    // Whether reading stopped on an error, e.g. the process exited, rather than at the end.
+    bool Error() const { return error_; }
+    // The entry stays valid until the next call.
+    bool Next(lsplt::MapEntry &entry);
+    // Parses a single line without the trailing newline.
+    static bool ParseLine(std::string_view line, lsplt::MapEntry &entry);
+};
+
+// Targeted VMA lookups through the PROCMAP_QUERY ioctl on /proc/<pid>/maps (Linux 6.11+).
+// Each query returns one VMA in binary form, so callers only pay for the mappings they ask for.
+class MapsQuery {
+    int fd_ = -1;
+    std::array<char, PATH_MAX> name_{};
+
+public:
+    static constexpr uint64_t kReadable = 0x01;
+    static constexpr uint64_t kWritable = 0x02;
+    static constexpr uint64_t kExecutable = 0x04;
+    static constexpr uint64_t kShared = 0x08;
+    static constexpr uint64_t kCoveringOrNext = 0x10;
+    static constexpr uint64_t kFileBacked = 0x20;
+
+    MapsQuery(std::string_view pid);
+    ~MapsQuery();
+    MapsQuery(const MapsQuery &) = delete;
+    MapsQuery &operator=(const MapsQuery &) = delete;
+
+    // Probes once whether the running kernel answers PROCMAP_QUERY for this process.
+    static bool Supported();
+
+    bool Valid() const { return fd_ >= 0; }
+    // Finds the VMA covering addr, or with kCoveringOrNext the first one after it, that matches
+    // the given kReadable/kWritable/kExecutable/kFileBacked flags. The path is only filled when
+    // with_name is set, and stays valid until the next call.
+    bool Query(uintptr_t addr, uint64_t flags, lsplt::MapEntry &entry, bool with_name = false);
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Runs task(i) for every i in [0, count) on up to workers threads, the calling thread included.
+// Indices are handed out one at a time, so uneven tasks still balance. Threads are created with
+// pthread_create, which reports failure instead of throwing, and whatever could not be spawned
+// is left to the threads that were, down to the calling thread alone.
+template <typename Task>
+void ParallelFor(size_t count, size_t workers, Task &&task) {
+    if (count == 0) return;
+    workers = std::clamp<size_t>(workers, 1, count);
+    if (workers <= 1) {
+        for (size_t i = 0; i < count; ++i) task(i);
+        return;
+    }
+    std::atomic_size_t next = 0;
+    auto run = [&] {
+        for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count;) task(i);
+    };
+    std::vector<pthread_t> threads;
+    threads.reserve(workers - 1);
+    for (size_t i = 1; i < workers; ++i) {
+        pthread_t thread;
+        if (pthread_create(
+                &thread, nullptr,
+                [](void *arg) -> void * {
+                    (*static_cast<decltype(run) *>(arg))();
+                    return nullptr;
+                },
+                &run) != 0) {
+            break;
+        }
+        threads.emplace_back(thread);
+    }
+    run();
+    for (auto thread : threads) pthread_join(thread, nullptr);
+}
+
+inline size_t DefaultWorkers() {
+    constexpr size_t kMaxWorkers = 4;
+    return std::clamp<size_t>(std::thread::hardware_concurrency(), 1, kMaxWorkers);
+}
@@ -0,0 +1,263 @@
+#include "plan_cache.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "hash.hpp"
+#include "logging.hpp"
+
+struct PlanCache::Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t library_count;
+    uint32_t symbol_count;
+    uint32_t slot_count;
+    uint32_t string_size;
+    uint32_t reserved;
+    // of everything after the header
+    uint64_t checksum;
+};
+
+struct PlanCache::LibraryRecord {
+    uint64_t dev;
+    uint64_t inode;
+    uint64_t relocations;
+    uint32_t build_id;
+    uint32_t build_id_size;
+    uint32_t first_symbol;
+    uint32_t symbol_count;
+};
+
+struct PlanCache::SymbolRecord {
+    uint32_t name;
+    uint32_t name_size;
+    uint32_t first_slot;
+    uint32_t slot_count;
+};
+
+namespace {
+constexpr char kMagic[8] = "LSPLTPC";
+constexpr uint32_t kVersion = 2;
+
+bool WriteAll(int fd, const void *data, size_t size) {
+    for (const auto *cur = static_cast<const char *>(data); size > 0;) {
+        auto written = write(fd, cur, size);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        cur += written;
+        size -= written;
+    }
+    return true;
+}
+
+template <typename T>
+bool WriteAll(int fd, const std::vector<T> &items) {
+    return WriteAll(fd, items.data(), items.size() * sizeof(T));
+}
+}  // namespace
+
+bool PlanCache::Open(std::string_view path) {
+    Close();
+    path_ = path;
+    return Map();
+}
+
+void PlanCache::Close() {
+    Unmap();
+    path_.clear();
+    recorded_.clear();
+}
+
+bool PlanCache::Map() {
+    int fd = open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return errno == ENOENT;
+    struct stat st {};
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(Header))) {
+        close(fd);
+        return false;
+    }
+    size_ = st.st_size;
+    data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data_ == MAP_FAILED) {
+        data_ = nullptr;
+        return false;
+    }
+
+    const auto *header = static_cast<const Header *>(data_);
+    const uint64_t expected = sizeof(Header) +
+                              uint64_t{header->library_count} * sizeof(LibraryRecord) +
+                              uint64_t{header->symbol_count} * sizeof(SymbolRecord) +
+                              uint64_t{header->slot_count} * sizeof(uint64_t) +
+                              header->string_size;
+    if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 || header->version != kVersion ||
+        expected != size_ ||
+        Fingerprint(header + 1, size_ - sizeof(Header)) != header->checksum) {
+        LOGW("Ignoring invalid plan cache %s", path_.c_str());
+        Unmap();
+        return false;
+    }
+    libraries_ = reinterpret_cast<const LibraryRecord *>(header + 1);
+    symbols_ = reinterpret_cast<const SymbolRecord *>(libraries_ + header->library_count);
+    slots_ = reinterpret_cast<const uint64_t *>(symbols_ + header->symbol_count);
+    strings_ = reinterpret_cast<const char *>(slots_ + header->slot_count);
+    library_count_ = header->library_count;
+
+    // everything is bounds checked once here, so lookups can trust the records
+    auto in_strings = [header](uint32_t offset, uint32_t size) {
+        return uint64_t{offset} + size <= header->string_size;
+    };
+    for (const auto &library : std::span(libraries_, library_count_)) {
+        if (!in_strings(library.build_id, library.build_id_size) ||
+            uint64_t{library.first_symbol} + library.symbol_count > header->symbol_count) {
+            library_count_ = 0;
+        }
+    }
+    for (const auto &symbol : std::span(symbols_, header->symbol_count)) {
+        if (!in_strings(symbol.name, symbol.name_size) ||
+            uint64_t{symbol.first_slot} + symbol.slot_count > header->slot_count) {
+            library_count_ = 0;
+        }
+    }
+    if (library_count_ != header->library_count) {
+        LOGW("Ignoring corrupted plan cache %s", path_.c_str());
+        Unmap();
+        return false;
+    }
+    return true;
+}
+
+void PlanCache::Unmap() {
+    if (data_) munmap(data_, size_);
+    data_ = nullptr;
+    size_ = 0;
+    libraries_ = nullptr;
+    symbols_ = nullptr;
+    slots_ = nullptr;
+    strings_ = nullptr;
+    library_count_ = 0;
+}
+
+std::optional<std::span<const uint64_t>> PlanCache::Find(dev_t dev, ino_t inode,
+                                                         std::string_view build_id,
+                                                         uint64_t relocations,
+                                                         std::string_view symbol) const {
+    if (build_id.empty()) return std::nullopt;
+    const std::tuple key{static_cast<uint64_t>(dev), static_cast<uint64_t>(inode), build_id,
+                         relocations};
+    if (auto plans = recorded_.find(key); plans != recorded_.end()) {
+        if (auto iter = plans->second.find(symbol); iter != plans->second.end()) {
+            return iter->second;
+        }
+    }
+
+    const std::span libraries(libraries_, library_count_);
+    auto library = std::ranges::lower_bound(libraries, key, {}, [this](const auto &record) {
+        return std::tuple{record.dev, record.inode,
+                          String(record.build_id, record.build_id_size), record.relocations};
+    });
+    if (library == libraries.end() || library->dev != std::get<0>(key) ||
+        library->inode != std::get<1>(key) ||
+        String(library->build_id, library->build_id_size) != build_id ||
+        library->relocations != relocations) {
+        return std::nullopt;
+    }
+    const std::span symbols(symbols_ + library->first_symbol, library->symbol_count);
+    auto iter = std::ranges::lower_bound(symbols, symbol, {}, [this](const auto &record) {
+        return String(record.name, record.name_size);
+    });
+    if (iter == symbols.end() || String(iter->name, iter->name_size) != symbol) {
+        return std::nullopt;
+    }
+    return std::span(slots_ + iter->first_slot, iter->slot_count);
+}
+
+void PlanCache::Record(dev_t dev, ino_t inode, std::string_view build_id, uint64_t relocations,
+                       std::string_view symbol, std::span<const uint64_t> offsets) {
+    if (path_.empty() || build_id.empty()) return;
+    auto &plans = recorded_[Key{dev, inode, build_id, relocations}];
+    plans.insert_or_assign(std::string{symbol},
+                           std::vector<uint64_t>{offsets.begin(), offsets.end()});
+}
+
+bool PlanCache::Save() {
+    if (path_.empty() || recorded_.empty()) return true;
+
+    // what is recorded here wins over the mapped file
+    auto merged = recorded_;
+    for (const auto &library : std::span(libraries_, library_count_)) {
+        auto &plans = merged[Key{library.dev, library.inode,
+                                 String(library.build_id, library.build_id_size),
+                                 library.relocations}];
+        const std::span symbols(symbols_ + library.first_symbol, library.symbol_count);
+        for (const auto &symbol : symbols) {
+            plans.try_emplace(std::string{String(symbol.name, symbol.name_size)},
+                              slots_ + symbol.first_slot,
+                              slots_ + symbol.first_slot + symbol.slot_count);
+        }
+    }
+
+    std::vector<LibraryRecord> libraries;
+    std::vector<SymbolRecord> symbols;
+    std::vector<uint64_t> slots;
+    std::vector<char> strings;
+    libraries.reserve(merged.size());
+    for (const auto &[key, plans] : merged) {
+        const auto &[dev, inode, build_id, relocations] = key;
+        libraries.push_back({dev, inode, relocations, static_cast<uint32_t>(strings.size()),
+                             static_cast<uint32_t>(build_id.size()),
+                             static_cast<uint32_t>(symbols.size()),
+                             static_cast<uint32_t>(plans.size())});
+        strings.insert(strings.end(), build_id.begin(), build_id.end());
+        for (const auto &[name, offsets] : plans) {
+            symbols.push_back({static_cast<uint32_t>(strings.size()),
+                               static_cast<uint32_t>(name.size()),
+                               static_cast<uint32_t>(slots.size()),
+                               static_cast<uint32_t>(offsets.size())});
+            strings.insert(strings.end(), name.begin(), name.end());
+            slots.insert(slots.end(), offsets.begin(), offsets.end());
+        }
+    }
+    Header header{{}, kVersion, static_cast<uint32_t>(libraries.size()),
+                  static_cast<uint32_t>(symbols.size()), static_cast<uint32_t>(slots.size()),
+                  static_cast<uint32_t>(strings.size()), 0, Fingerprint(nullptr, 0)};
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    // the parts are written back to back and all but the strings are whole words, so chaining
+    // them gives the fingerprint of the file after the header
+    using Part = std::pair<const void *, size_t>;
+    for (const auto &[data, size] : {
+             Part{libraries.data(), libraries.size() * sizeof(LibraryRecord)},
+             Part{symbols.data(), symbols.size() * sizeof(SymbolRecord)},
+             Part{slots.data(), slots.size() * sizeof(uint64_t)},
+             Part{strings.data(), strings.size()},
+         }) {
+        header.checksum = Fingerprint(data, size, header.checksum);
+    }
+
+    // processes saving at once each rename a complete file, the last one wins
+    auto temp = path_ + ".tmp." + std::to_string(getpid());
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOGW("Failed to create plan cache %s", temp.c_str());
+        return false;
+    }
+    bool written = WriteAll(fd, &header, sizeof(header)) && WriteAll(fd, libraries) &&
+                   WriteAll(fd, symbols) && WriteAll(fd, slots) && WriteAll(fd, strings);
+    written = close(fd) == 0 && written;
+    if (!written || rename(temp.c_str(), path_.c_str()) != 0) {
+        LOGW("Failed to write plan cache %s", path_.c_str());
+        unlink(temp.c_str());
+        return false;
+    }
+
+    recorded_.clear();
+    Unmap();
+    Map();
+    return true;
+}
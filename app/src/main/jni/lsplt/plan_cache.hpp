@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <functional>
+#include <map>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+// Hook plans shared between processes: for every library, identified by (dev, inode), its build
+// ID and where its relocation tables lie, the GOT slots of the symbols already looked up in it,
+// as offsets from its load bias.
+// The file is mapped read-only and searched in place. Plans recorded meanwhile are kept aside
+// until Save merges them into a new file, which replaces the old one by rename so that other
+// processes only ever map a complete file. A fingerprint of everything after the header is
+// checked when mapping it, so a damaged file is never used.
+//
+// Layout, in native byte order:
+//   Header
+//   LibraryRecord[library_count]  sorted by (dev, inode, build ID, relocations)
+//   SymbolRecord[symbol_count]    those of each library together, sorted by name
+//   uint64_t[slot_count]          offsets from the load bias
+//   char[string_size]             build IDs and names
+class PlanCache {
+    struct Header;
+    struct LibraryRecord;
+    struct SymbolRecord;
+
+    using Key = std::tuple<uint64_t, uint64_t, std::string, uint64_t>;
+    using Plans = std::map<std::string, std::vector<uint64_t>, std::less<>>;
+
+    std::string path_;
+    void *data_ = nullptr;
+    size_t size_ = 0;
+    const LibraryRecord *libraries_ = nullptr;
+    const SymbolRecord *symbols_ = nullptr;
+    const uint64_t *slots_ = nullptr;
+    const char *strings_ = nullptr;
+    size_t library_count_ = 0;
+    std::map<Key, Plans, std::less<>> recorded_;
+
+    bool Map();
+    void Unmap();
+    std::string_view String(uint32_t offset, uint32_t size) const {
+        return {strings_ + offset, size};
+    }
+
+public:
+    PlanCache() = default;
+    ~PlanCache() { Unmap(); }
+    PlanCache(const PlanCache &) = delete;
+    PlanCache &operator=(const PlanCache &) = delete;
+
+    // Uses the cache file at path, which need not exist yet. Returns false if it exists but is
+    // not a valid cache, in which case it is only written over by the next Save.
+    bool Open(std::string_view path);
+    void Close();
+    const std::string &Path() const { return path_; }
+
+    // The slots of symbol in the library, or nullopt if they were never recorded for a library
+    // whose relocation tables lie as given.
+    std::optional<std::span<const uint64_t>> Find(dev_t dev, ino_t inode,
+                                                  std::string_view build_id, uint64_t relocations,
+                                                  std::string_view symbol) const;
+    // Libraries without a build ID are not recorded, as a rebuilt file could reuse the inode.
+    void Record(dev_t dev, ino_t inode, std::string_view build_id, uint64_t relocations,
+                std::string_view symbol, std::span<const uint64_t> offsets);
+    // Writes out the file with what was recorded since the last call.
+    bool Save();
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// What lsplt::GetStats() reports. Every counter is only ever added to and read on its own, so
+// relaxed atomics are enough, and hot loops count locally and add once at the end.
+struct StatCounters {
+    std::atomic<uint64_t> scans;
+    std::atomic<uint64_t> maps_parsed;
+    std::atomic<uint64_t> elfs_parsed;
+    std::atomic<uint64_t> gnu_lookups;
+    std::atomic<uint64_t> sysv_lookups;
+    std::atomic<uint64_t> linear_lookups;
+    std::atomic<uint64_t> relocations_walked;
+    std::atomic<uint64_t> pages_shadowed;
+    std::atomic<uint64_t> bytes_copied;
+    std::atomic<uint64_t> scan_ns;
+    std::atomic<uint64_t> filter_ns;
+    std::atomic<uint64_t> analysis_ns;
+    std::atomic<uint64_t> patch_ns;
+};
+
+inline StatCounters stats;
+
+inline void Count(std::atomic<uint64_t> &counter, uint64_t count = 1) {
+    counter.fetch_add(count, std::memory_order_relaxed);
+}
+
+// Adds the time from its construction to its destruction to a phase counter.
+class PhaseTimer {
+    std::atomic<uint64_t> &total_;
+    std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+
+public:
+    explicit PhaseTimer(std::atomic<uint64_t> &total) : total_(total) {}
+    ~PhaseTimer() {
+        Count(total_, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - start_)
+                          .count());
+    }
+    PhaseTimer(const PhaseTimer &) = delete;
+    PhaseTimer &operator=(const PhaseTimer &) = delete;
+};
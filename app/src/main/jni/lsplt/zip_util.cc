@@ -0,0 +1,165 @@
+#include "zip_util.hpp"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "logging.hpp"
+
+namespace {
+constexpr uint32_t kEocdSignature = 0x06054b50;
+constexpr uint32_t kEocd64LocatorSignature = 0x07064b50;
+constexpr uint32_t kEocd64Signature = 0x06064b50;
+constexpr uint32_t kCentralSignature = 0x02014b50;
+constexpr uint32_t kLocalSignature = 0x04034b50;
+constexpr size_t kEocdSize = 22;
+constexpr size_t kEocd64LocatorSize = 20;
+constexpr size_t kEocd64Size = 56;
+constexpr size_t kCentralSize = 46;
+constexpr size_t kLocalSize = 30;
+constexpr size_t kMaxCommentSize = UINT16_MAX;
+constexpr uint16_t kZip64ExtraId = 0x0001;
+constexpr uint16_t kStored = 0;
+constexpr std::string_view kLibPrefix = "lib/";
+constexpr std::string_view kLibSuffix = ".so";
+
+// zip fields are little endian and unaligned, like every ABI Android runs on
+template <typename T>
+T Read(const char *data) {
+    T value;
+    memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+// lib/<abi>/<name>.so, not in a deeper directory
+bool IsLibrary(std::string_view name) {
+    if (!name.starts_with(kLibPrefix) || !name.ends_with(kLibSuffix)) return false;
+    auto slash = name.find('/', kLibPrefix.size());
+    return slash != std::string_view::npos && slash > kLibPrefix.size() &&
+           name.find('/', slash + 1) == std::string_view::npos &&
+           name.size() > slash + 1 + kLibSuffix.size();
+}
+
+// The central directory as the End of Central Directory record, or its Zip64 version when a
+// field overflowed, describes it.
+struct CentralDirectory {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t count;
+};
+
+std::optional<CentralDirectory> FindCentralDirectory(const char *data, size_t size) {
+    if (size < kEocdSize) return std::nullopt;
+    // the record sits at the very end, followed only by a comment of at most 64 KiB
+    const size_t lowest = size - kEocdSize > kMaxCommentSize ? size - kEocdSize - kMaxCommentSize
+                                                             : 0;
+    for (size_t eocd = size - kEocdSize + 1; eocd-- > lowest;) {
+        const char *record = data + eocd;
+        if (Read<uint32_t>(record) != kEocdSignature ||
+            eocd + kEocdSize + Read<uint16_t>(record + 20) > size) {
+            continue;
+        }
+        CentralDirectory directory{Read<uint32_t>(record + 16), Read<uint32_t>(record + 12),
+                                   Read<uint16_t>(record + 10)};
+        if (directory.offset == UINT32_MAX || directory.size == UINT32_MAX ||
+            directory.count == UINT16_MAX) {
+            if (eocd < kEocd64LocatorSize) return std::nullopt;
+            const char *locator = record - kEocd64LocatorSize;
+            if (Read<uint32_t>(locator) != kEocd64LocatorSignature) return std::nullopt;
+            auto eocd64 = Read<uint64_t>(locator + 8);
+            if (size < kEocd64Size || eocd64 > size - kEocd64Size) return std::nullopt;
+            const char *record64 = data + eocd64;
+            if (Read<uint32_t>(record64) != kEocd64Signature) return std::nullopt;
+            directory = {Read<uint64_t>(record64 + 48), Read<uint64_t>(record64 + 40),
+                         Read<uint64_t>(record64 + 32)};
+        }
+        if (directory.offset > size || directory.size > size - directory.offset) {
+            return std::nullopt;
+        }
+        return directory;
+    }
+    return std::nullopt;
+}
+}  // namespace
+
+std::optional<ApkLibraries> ApkLibraries::Parse(int fd, size_t size) {
+    if (size < kEocdSize) return std::nullopt;
+    auto *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return std::nullopt;
+    const auto *data = static_cast<const char *>(map);
+    const uint64_t page_size = getpagesize();
+
+    std::optional<ApkLibraries> libraries;
+    if (auto directory = FindCentralDirectory(data, size)) {
+        libraries.emplace();
+        const char *cur = data + directory->offset;
+        const char *end = cur + directory->size;
+        for (uint64_t i = 0; i < directory->count; ++i) {
+            if (static_cast<size_t>(end - cur) < kCentralSize ||
+                Read<uint32_t>(cur) != kCentralSignature) {
+                libraries.reset();
+                break;
+            }
+            const auto method = Read<uint16_t>(cur + 10);
+            uint64_t compressed = Read<uint32_t>(cur + 20);
+            uint64_t uncompressed = Read<uint32_t>(cur + 24);
+            const auto name_size = Read<uint16_t>(cur + 28);
+            const auto extra_size = Read<uint16_t>(cur + 30);
+            const auto comment_size = Read<uint16_t>(cur + 32);
+            uint64_t local = Read<uint32_t>(cur + 42);
+            const size_t entry_size = kCentralSize + name_size + extra_size + comment_size;
+            if (static_cast<size_t>(end - cur) < entry_size) {
+                libraries.reset();
+                break;
+            }
+            const std::string_view name(cur + kCentralSize, name_size);
+            const char *extra = cur + kCentralSize + name_size;
+            cur += entry_size;
+            if (method != kStored || !IsLibrary(name)) continue;
+
+            // fields that overflowed are in the Zip64 extra field, in this order
+            for (const char *field = extra; field + 4 <= extra + extra_size;) {
+                const auto id = Read<uint16_t>(field);
+                const auto field_size = Read<uint16_t>(field + 2);
+                const char *value = field + 4;
+                field = value + field_size;
+                if (id != kZip64ExtraId || field > extra + extra_size) continue;
+                for (auto *overflowed : {&uncompressed, &compressed, &local}) {
+                    if (*overflowed != UINT32_MAX || value + 8 > field) continue;
+                    *overflowed = Read<uint64_t>(value);
+                    value += 8;
+                }
+                break;
+            }
+
+            // the local header repeats the name, but its extra field may differ
+            if (compressed != uncompressed || local > size - kLocalSize) continue;
+            const char *header = data + local;
+            if (Read<uint32_t>(header) != kLocalSignature) continue;
+            const uint64_t offset =
+                local + kLocalSize + Read<uint16_t>(header + 26) + Read<uint16_t>(header + 28);
+            if (offset % page_size != 0 || offset > size || uncompressed > size - offset) {
+                continue;
+            }
+            libraries->entries_.push_back({static_cast<uint32_t>(libraries->names_.size()),
+                                           name_size, offset, uncompressed});
+            libraries->names_.append(name);
+        }
+    }
+    munmap(map, size);
+    if (!libraries) return std::nullopt;
+
+    auto &self = *libraries;
+    std::ranges::sort(self.entries_, {}, [&self](const Entry &entry) { return self.Name(entry); });
+    LOGD("Found %zu libraries in APK", self.entries_.size());
+    return libraries;
+}
+
+const ApkLibraries::Entry *ApkLibraries::Find(std::string_view name) const {
+    auto iter = std::ranges::lower_bound(entries_, name, {},
+                                         [this](const Entry &entry) { return Name(entry); });
+    if (iter == entries_.end() || Name(*iter) != name) return nullptr;
+    return &*iter;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The native libraries an APK stores uncompressed, lib/<abi>/<name>.so, with where their data
+// lies in the file. The APK is mapped read-only while its End of Central Directory and central
+// directory are walked in place, so only the libraries found are copied out, their names into
+// one buffer. Entries are kept sorted by name for lookups.
+class ApkLibraries {
+public:
+    struct Entry {
+        uint32_t name;
+        uint32_t name_size;
+        uint64_t offset;
+        uint64_t size;
+    };
+
+private:
+    std::string names_;
+    std::vector<Entry> entries_;
+
+public:
+    // Parses the APK open at fd, which is size bytes long. Only libraries whose data starts on a
+    // page boundary are kept, as the linker cannot map any other one. Returns nullopt if it is
+    // not a valid zip file.
+    static std::optional<ApkLibraries> Parse(int fd, size_t size);
+
+    const std::vector<Entry> &Entries() const { return entries_; }
+    std::string_view Name(const Entry &entry) const {
+        return {names_.data() + entry.name, entry.name_size};
+    }
+    // The entry with the given full name, e.g. lib/arm64-v8a/libfoo.so.
+    const Entry *Find(std::string_view name) const;
+};
@@ -139,7 +139,8 @@ jint JNI_OnLoad(JavaVM *jvm, void *v __unused) {
     } else {
         LOGV("stat: dev=%lu, inode=%lu, path=%s",
              (unsigned long) st.st_dev, (unsigned long) st.st_ino, runtime_path);
-        if (lsplt::RegisterHook(st.st_dev, st.st_ino, "capset", (void *) skip_capset, nullptr)) {
+        if (lsplt::RegisterHook(st.st_dev, st.st_ino, lsplt::Symbol{"capset"},
+                                (void *) skip_capset, nullptr)) {
             if (!lsplt::CommitHook()) {
                 PLOGE("CommitHook failed");
             } else {